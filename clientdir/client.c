@@ -18,70 +18,205 @@ int isCmdValid = 0;
 
 void validate_command(char *command);
 
-void receive_tar_file(int socket) {
-    long file_size;
-    if (recv(socket, &file_size, sizeof(file_size), 0) == -1) {
-        perror("Error receiving file size");
-        return;
-    }
+// ------------------------------------- framing -------------------------------
+
+// Every message to and from the server is a frame: a 12-byte header (version, type, flags,
+// request id, payload length, all in network order) followed by the payload. A command is one
+// FRAME_COMMAND; its reply is any FRAME_ARCHIVE chunks closed by FRAME_ARCHIVE_END when there is
+// an archive, then one FRAME_RESPONSE with the text.
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum frame_type {
+    FRAME_COMMAND = 1,
+    FRAME_ARCHIVE = 2,
+    FRAME_ARCHIVE_END = 3,
+    FRAME_RESPONSE = 4
+};
+
+// On FRAME_ARCHIVE_END: the archive was cut short. On FRAME_RESPONSE: the command was refused.
+#define FRAME_FLAG_ERROR 0x1
+
+struct frame_header {
+    unsigned char version;
+    unsigned char type;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t length;
+};
+
+void frame_header_pack(unsigned char *bytes, int type, int flags, uint32_t request_id, size_t length) {
+    uint16_t net_flags = htons((uint16_t) flags);
+    uint32_t net_request_id = htonl(request_id);
+    uint32_t net_length = htonl((uint32_t) length);
+    bytes[0] = FRAME_VERSION;
+    bytes[1] = (unsigned char) type;
+    memcpy(bytes + 2, &net_flags, sizeof(net_flags));
+    memcpy(bytes + 4, &net_request_id, sizeof(net_request_id));
+    memcpy(bytes + 8, &net_length, sizeof(net_length));
+}
 
-    printf("%ld\n", file_size);
+// Returns -1 for a header of another version or with an oversized payload
+int frame_header_unpack(const unsigned char *bytes, struct frame_header *header) {
+    uint16_t net_flags;
+    uint32_t net_request_id;
+    uint32_t net_length;
+    memcpy(&net_flags, bytes + 2, sizeof(net_flags));
+    memcpy(&net_request_id, bytes + 4, sizeof(net_request_id));
+    memcpy(&net_length, bytes + 8, sizeof(net_length));
+    header->version = bytes[0];
+    header->type = bytes[1];
+    header->flags = ntohs(net_flags);
+    header->request_id = ntohl(net_request_id);
+    header->length = ntohl(net_length);
+    return header->version == FRAME_VERSION && header->length <= FRAME_MAX_PAYLOAD ? 0 : -1;
+}
 
-    if (file_size == 0) {
-        printf("No file to receive.\n");
-        return;
+// Send a command of at most BUFFER_SIZE bytes as one frame
+int send_command(int socket, uint32_t request_id, const char *command) {
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    size_t length = strlen(command);
+    frame_header_pack(frame, FRAME_COMMAND, 0, request_id, length);
+    memcpy(frame + FRAME_HEADER_SIZE, command, length);
+    const unsigned char *data = frame;
+    length += FRAME_HEADER_SIZE;
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, 0);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
     }
+    return 0;
+}
 
-    char *buffer = (char *)malloc(file_size);
-    if (buffer == NULL) {
-        perror("Memory allocation error");
-        return;
+// Read exactly length bytes; returns 0 on success, -1 on error or early close
+int recv_all(int socket, void *buffer, size_t length) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t received = recv(socket, bytes, length, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        bytes += received;
+        length -= received;
     }
+    return 0;
+}
 
-    ssize_t bytes_received = recv(socket, buffer, file_size, 0);
-    if (bytes_received <= 0) {
-        if (bytes_received == 0) {
+// Read the frames answering one command: archive chunks go to file_name, opened on the first
+// one, and the closing response text goes to stdout. Payloads are read in pieces of a fixed
+// buffer, so no frame is assumed to arrive in one recv(). Returns -1 when the connection is lost
+// or out of step with its requests and can no longer be used.
+int receive_reply(int socket, uint32_t request_id, const char *file_name) {
+    FILE *file = NULL;
+    long total = 0;
+    char buffer[65536];
+    int status = -1;
+    while (1) {
+        unsigned char bytes[FRAME_HEADER_SIZE];
+        struct frame_header header;
+        if (recv_all(socket, bytes, sizeof(bytes)) != 0) {
             printf("Connection closed by the server.\n");
-        } else {
-            perror("Error receiving file data");
+            break;
+        }
+        if (frame_header_unpack(bytes, &header) != 0) {
+            fprintf(stderr, "Malformed frame from the server\n");
+            break;
+        }
+        if (header.request_id != request_id) {
+            // A reply meant for another request: nothing read from here on can be trusted
+            fprintf(stderr, "Protocol error: frame for request %u while waiting on %u\n", header.request_id,
+                    request_id);
+            break;
+        }
+        if (header.type == FRAME_ARCHIVE && file == NULL) {
+            file = fopen(file_name, "wb");
+            if (file == NULL) {
+                perror("Error opening destination file");
+            }
         }
-        free(buffer);
-        return;
-    }
 
-    FILE *file = fopen("received.tar.gz", "wb");
-    if (file == NULL) {
-        perror("Error opening destination file");
-        free(buffer);
-        return;
-    }
+        size_t remaining = header.length;
+        int failed = 0;
+        while (remaining > 0) {
+            size_t piece = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (recv_all(socket, buffer, piece) != 0) {
+                perror("Error receiving frame payload");
+                failed = 1;
+                break;
+            }
+            if (header.type == FRAME_ARCHIVE) {
+                if (file != NULL && fwrite(buffer, 1, piece, file) < piece) {
+                    perror("Error writing to file");
+                }
+                total += piece;
+            } else if (header.type == FRAME_RESPONSE) {
+                fwrite(buffer, 1, piece, stdout);
+            }
+            remaining -= piece;
+        }
+        if (failed) {
+            break;
+        }
 
-    size_t bytes_written = fwrite(buffer, 1, bytes_received, file);
-    if (bytes_written < bytes_received) {
-        perror("Error writing to file");
-    } else {
-        printf("File received and saved as 'received.tar.gz'.\n");
+        if (header.type == FRAME_ARCHIVE_END) {
+            if (header.flags & FRAME_FLAG_ERROR) {
+                printf("Archive '%s' is incomplete: the server stopped after %ld bytes.\n", file_name, total);
+            } else {
+                printf("File received and saved as '%s' (%ld bytes).\n", file_name, total);
+            }
+            if (file != NULL && fclose(file) == EOF) {
+                perror("Error closing destination file");
+            }
+            file = NULL;
+        } else if (header.type == FRAME_RESPONSE) {
+            printf("\n");
+            status = 0;
+            break;
+        }
     }
-
-    if (fclose(file) == EOF) {
-        perror("Error closing destination file");
+    if (file != NULL) {
+        fclose(file);
     }
-
-    free(buffer);
+    return status;
 }
 
-
-void receive_response(int socket) {
-    char response[BUFFER_SIZE];
-    ssize_t bytes_received = recv(socket, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        printf("Response from server: %s\n", response);
-    } else if (bytes_received == 0) {
-        printf("Connection closed by the server.\n");
-    } else {
-        perror("Error receiving response");
+// Remove "-c <codec>[:<level>]" from a command so it validates as before, and pick the
+// file name the archive is saved under from the codec or -u
+const char *take_codec_option(char *command) {
+    const char *file_name = "received.tar.gz";
+    char rest[1024] = "";
+    char *token = strtok(command, " ");
+    while (token != NULL) {
+        if (strcmp(token, "-c") == 0) {
+            char *codec = strtok(NULL, " ");
+            if (codec == NULL) {
+                break;
+            }
+            if (strncmp(codec, "store", 5) == 0) {
+                file_name = "received.tar";
+            } else if (strncmp(codec, "zstd", 4) == 0) {
+                file_name = "received.tar.zst";
+            } else if (strncmp(codec, "lz4", 3) == 0) {
+                file_name = "received.tar.lz4";
+            }
+        } else {
+            // -u asks for the archive uncompressed; it stays in the command
+            if (strcmp(token, "-u") == 0) {
+                file_name = "received.tar";
+            }
+            if (rest[0] != '\0') {
+                strcat(rest, " ");
+            }
+            strcat(rest, token);
+        }
+        token = strtok(NULL, " ");
     }
+    strcpy(command, rest);
+    return file_name;
 }
 
 
@@ -115,6 +250,7 @@ int main(int argc, char *argv[]) {
 
     char command[BUFFER_SIZE];
     int is_valid;
+    uint32_t request_id = 0;
 
     while (1) {
         // Read command from the user
@@ -130,30 +266,22 @@ int main(int argc, char *argv[]) {
         char tempCmdArr[1024];
         strcpy(tempCmdArr, cmdArr);
 
+        const char *archive_name = take_codec_option(tempCmdArr);
         validate_command(tempCmdArr);
         if (isCmdValid == 1) {
             printf("\nisCmdValid :: => :: %d\n", isCmdValid);
-            send(client_socket, cmdArr, strlen(cmdArr), 0);
+            request_id++;
+            send_command(client_socket, request_id, cmdArr);
             if (strcmp(cmdArr, "quit") == 0) {
                 close(client_socket);
                 break;
             }
             printf("Message from the server:\n\n");
-
-            // Receive the flag from the server
-            int flag;
-            recv(client_socket, &flag, sizeof(int), 0);
-            printf("%d\n",flag);
-
-            if (flag == 1) {
-                receive_tar_file(client_socket);
+            if (receive_reply(client_socket, request_id, archive_name) != 0) {
+                close(client_socket);
+                exit(4);
             }
 
-            printf("printing response:\n");
-            char server_response[1024];
-            recv(client_socket, server_response, sizeof(server_response)-1, 0);
-            printf("%s", server_response);
-
         } else {
             printf("\ncommand is not valid\n");
         }
@@ -196,7 +324,8 @@ int substrExists(const char *command, const char *substring) {
 void validate_fGets(char *cmd) {
     int c = checkInputCmd(cmd);
     printf("%d\n", c);
-    if (c <= 5) {
+    // fgets and one to four file names
+    if (c >= 2 && c <= 5) {
         isCmdValid = 1;
     } else {
         isCmdValid = 0;
@@ -282,16 +411,62 @@ void validate_getDirf(char *cmd) {
     }
 }
 
+// query [size size1 size2] [date date1 date2] [ext ext1,ext2,...] [name pattern] <-u>
+// At least one predicate, each at most once
+void validate_query(char *cmd) {
+    int seen = 0;
+    char *keyword = strtok(cmd, " ");  // "query"
+    isCmdValid = 0;
+    while ((keyword = strtok(NULL, " ")) != NULL) {
+        if (strcmp(keyword, "size") == 0 && !(seen & 1)) {
+            char *size1 = strtok(NULL, " ");
+            char *size2 = strtok(NULL, " ");
+            if (size1 == NULL || size2 == NULL || atoi(size1) < 0 || atoi(size1) > atoi(size2)) {
+                break;
+            }
+            seen |= 1;
+        } else if (strcmp(keyword, "date") == 0 && !(seen & 2)) {
+            char *date1 = strtok(NULL, " ");
+            char *date2 = strtok(NULL, " ");
+            if (date1 == NULL || date2 == NULL || !is_valid_date(date1) || !is_valid_date(date2) ||
+                strcmp(date1, date2) > 0) {
+                break;
+            }
+            seen |= 2;
+        } else if (strcmp(keyword, "ext") == 0 && !(seen & 4) && strtok(NULL, " ") != NULL) {
+            seen |= 4;
+        } else if (strcmp(keyword, "name") == 0 && !(seen & 8) && strtok(NULL, " ") != NULL) {
+            seen |= 8;
+        } else {
+            isCmdValid = strcmp(keyword, "-u") == 0 && seen != 0 && strtok(NULL, " ") == NULL;
+            if (!isCmdValid) {
+                printf("Invalid format, usage: query [size size1 size2] [date date1 date2] "
+                       "[ext ext1,ext2,...] [name pattern] <-u>");
+            }
+            return;
+        }
+    }
+    isCmdValid = keyword == NULL && seen != 0;
+    if (!isCmdValid) {
+        printf("Invalid format, usage: query [size size1 size2] [date date1 date2] "
+               "[ext ext1,ext2,...] [name pattern] <-u>");
+    }
+}
+
 void validate_command(char *command) {
     char *tempCmd = command;
-    if (substrExists(tempCmd, "fgets")) {
+    // Checked first: its patterns and extensions may contain the other command names
+    if (strncmp(tempCmd, "query ", 6) == 0) {
+        validate_query(command);
+    } else if (substrExists(tempCmd, "fgets")) {
         validate_fGets(command);
     } else if (substrExists(tempCmd, "tarfgetz")) {
         validate_tarGets(tempCmd);
     } else if (substrExists(tempCmd, "filesrch")) {
-        isCmdValid = 1;
+        // The server refuses a bare filesrch or targzf; they need a name or extension list
+        isCmdValid = checkInputCmd(command) >= 2;
     } else if (substrExists(tempCmd, "targzf")) {
-        isCmdValid = 1;
+        isCmdValid = checkInputCmd(command) >= 2;
     } else if (substrExists(tempCmd, "getdirf")) {
         validate_getDirf(command);
     } else if (substrExists(tempCmd, "quit")) {
@@ -12,13 +12,134 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <tar.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 
 #define PORT 9002
 #define BUFFER_SIZE 1024
+#define EWMA_ALPHA 0.2
+
+// Load figures shared by every session process and reported to the server's balancer
+struct mirror_load {
+    int sessions;
+    double ewma_ms;
+};
+
+static struct mirror_load *load;
 
 void processclient(int client_socket);
 
+// ------------------------------------- framing -------------------------------
+
+// Same framing as the server: a 12-byte header (version, type, flags, request id, payload length,
+// all in network order) in front of every payload. The mirror only reads FRAME_COMMAND and answers
+// each with one FRAME_RESPONSE carrying the command's request id.
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum frame_type {
+    FRAME_COMMAND = 1,
+    FRAME_ARCHIVE = 2,
+    FRAME_ARCHIVE_END = 3,
+    FRAME_RESPONSE = 4
+};
+
+#define FRAME_FLAG_ERROR 0x1
+
+struct frame_header {
+    unsigned char version;
+    unsigned char type;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t length;
+};
+
+void frame_header_pack(unsigned char *bytes, int type, int flags, uint32_t request_id, size_t length) {
+    uint16_t net_flags = htons((uint16_t) flags);
+    uint32_t net_request_id = htonl(request_id);
+    uint32_t net_length = htonl((uint32_t) length);
+    bytes[0] = FRAME_VERSION;
+    bytes[1] = (unsigned char) type;
+    memcpy(bytes + 2, &net_flags, sizeof(net_flags));
+    memcpy(bytes + 4, &net_request_id, sizeof(net_request_id));
+    memcpy(bytes + 8, &net_length, sizeof(net_length));
+}
+
+// Returns -1 for a header of another version or with an oversized payload
+int frame_header_unpack(const unsigned char *bytes, struct frame_header *header) {
+    uint16_t net_flags;
+    uint32_t net_request_id;
+    uint32_t net_length;
+    memcpy(&net_flags, bytes + 2, sizeof(net_flags));
+    memcpy(&net_request_id, bytes + 4, sizeof(net_request_id));
+    memcpy(&net_length, bytes + 8, sizeof(net_length));
+    header->version = bytes[0];
+    header->type = bytes[1];
+    header->flags = ntohs(net_flags);
+    header->request_id = ntohl(net_request_id);
+    header->length = ntohl(net_length);
+    return header->version == FRAME_VERSION && header->length <= FRAME_MAX_PAYLOAD ? 0 : -1;
+}
+
+int send_all(int socket, const void *buffer, size_t length) {
+    const char *data = buffer;
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Send a reply of at most BUFFER_SIZE bytes as one frame
+int send_frame(int socket, int type, int flags, uint32_t request_id, const void *payload, size_t length) {
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    if (length > BUFFER_SIZE) {
+        length = BUFFER_SIZE;
+    }
+    frame_header_pack(frame, type, flags, request_id, length);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    return send_all(socket, frame, FRAME_HEADER_SIZE + length);
+}
+
+// Read exactly length bytes; returns 0 on success, -1 on error or close
+int recv_all(int socket, void *buffer, size_t length) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t received = recv(socket, bytes, length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        bytes += received;
+        length -= received;
+    }
+    return 0;
+}
+
+// Read one frame into payload, which holds capacity bytes
+int recv_frame(int socket, struct frame_header *header, void *payload, size_t capacity) {
+    unsigned char bytes[FRAME_HEADER_SIZE];
+    if (recv_all(socket, bytes, sizeof(bytes)) != 0 || frame_header_unpack(bytes, header) != 0 ||
+        header->length > capacity) {
+        return -1;
+    }
+    return recv_all(socket, payload, header->length);
+}
+
 // ------------------------------------- validate_command -------------------------------
 
 int is_valid_date_format(const char *date_str) {
@@ -300,24 +421,30 @@ void handle_getdirf_command(char *arguments, char *response) {
     sprintf(response, "Tar archive created: %s", tar_name);
 }
 
+// The mirror keeps no file index to evaluate predicates against, so query is refused outright
+// rather than answered with an archive it never built. The server does not forward it here.
+void handle_query_command(char *arguments, char *response) {
+    (void) arguments;
+    sprintf(response, "query is not supported on the mirror");
+}
+
 void processclient(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+    char buffer[BUFFER_SIZE + 1];
+    struct frame_header header;
 
     while (1) {
-        // Receive command from the client
-        bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            // Client disconnected or error occurred
+        // Receive the next command frame from the client
+        if (recv_frame(client_socket, &header, buffer, BUFFER_SIZE) != 0 || header.type != FRAME_COMMAND) {
+            // Client disconnected, error occurred or the stream is out of step
             break;
         }
 
-        buffer[bytes_received] = '\0';
+        buffer[header.length] = '\0';
 
         // Validate the received command syntax
         if (!validate_command(buffer)) {
             char response[] = "Invalid command syntax";
-            send(client_socket, response, strlen(response), 0);
+            send_frame(client_socket, FRAME_RESPONSE, FRAME_FLAG_ERROR, header.request_id, response, strlen(response));
             continue;
         }
 
@@ -341,20 +468,37 @@ void processclient(int client_socket) {
         } else if (strcmp(command_type, "quit") == 0) {
             // Handle 'quit' command
             char quit_response[] = "Goodbye!";
-            send(client_socket, quit_response, strlen(quit_response), 0);
+            send_frame(client_socket, FRAME_RESPONSE, 0, header.request_id, quit_response, strlen(quit_response));
             break;
         } else {
             // Invalid command
             char invalid_response[] = "Invalid command";
-            send(client_socket, invalid_response, strlen(invalid_response), 0);
+            send_frame(client_socket, FRAME_RESPONSE, FRAME_FLAG_ERROR, header.request_id, invalid_response,
+                       strlen(invalid_response));
+            continue;
         }
 
         // Send the response back to the client
-        send(client_socket, response, strlen(response), 0);
+        send_frame(client_socket, FRAME_RESPONSE, 0, header.request_id, response, strlen(response));
     }
 }
 
 
+double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Answer the server's "load" probe with the sessions in progress and the smoothed reply time
+void send_load_report(int client_socket, uint32_t request_id) {
+    char report[64];
+    // The probe's own session is not load
+    int sessions = __atomic_load_n(&load->sessions, __ATOMIC_RELAXED) - 1;
+    snprintf(report, sizeof(report), "%d %.3f", sessions, load->ewma_ms);
+    send_frame(client_socket, FRAME_RESPONSE, 0, request_id, report, strlen(report));
+}
+
 int main(int argc, char *argv[]) {
     int server_socket, client_socket;
     int listen_fd, connection_fd, portNumber;
@@ -389,6 +533,14 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    load = mmap(NULL, sizeof(*load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (load == MAP_FAILED) {
+        perror("Error mapping load counters");
+        exit(1);
+    }
+    load->ewma_ms = 1.0;
+    signal(SIGCHLD, SIG_IGN);
+
     while (1) {
         // Accept client connection
         client_socket = accept(server_socket, (struct sockaddr *) NULL, NULL);
@@ -407,14 +559,33 @@ int main(int argc, char *argv[]) {
             // Child process
             pid_t pid = getpid();
             printf("child_pid :: => :: %d\n", pid);
+            close(server_socket);
+            __atomic_add_fetch(&load->sessions, 1, __ATOMIC_RELAXED);
 
             while (1) {
                 printf("Message from the client\n");
-                char buff1[1024];
-                recv(client_socket, buff1, sizeof(buff1), 0);
+                char buff1[BUFFER_SIZE + 1];
+                struct frame_header header;
+                if (recv_frame(client_socket, &header, buff1, BUFFER_SIZE) != 0 || header.type != FRAME_COMMAND) {
+                    break;
+                }
+                buff1[header.length] = '\0';
                 if (strcmp(buff1, "quit") == 0) {
                     break;
                 }
+                if (strcmp(buff1, "load") == 0) {
+                    send_load_report(client_socket, header.request_id);
+                    continue;
+                }
+                if (strcmp(buff1, "query") == 0 || strncmp(buff1, "query ", 6) == 0) {
+                    char response[BUFFER_SIZE];
+                    handle_query_command(buff1 + 5, response);
+                    send_frame(client_socket, FRAME_RESPONSE, FRAME_FLAG_ERROR, header.request_id, response,
+                               strlen(response));
+                    continue;
+                }
+                struct timespec started;
+                clock_gettime(CLOCK_MONOTONIC, &started);
                 printf("%s", buff1);
                 if (strcmp(buff1, "quit") == 0) {
                     exit(0);
@@ -427,8 +598,13 @@ int main(int argc, char *argv[]) {
                 if (input_length > 0 && buff[input_length - 1] == '\n') {
                     buff[input_length - 1] = '\0';
                 }
-                send(client_socket, buff, strlen(buff), 0);
+                send_frame(client_socket, FRAME_RESPONSE, 0, header.request_id, buff, strlen(buff));
+                load->ewma_ms = EWMA_ALPHA * elapsed_ms(&started) + (1 - EWMA_ALPHA) * load->ewma_ms;
             }
+
+            __atomic_sub_fetch(&load->sessions, 1, __ATOMIC_RELAXED);
+            close(client_socket);
+            exit(0);
         } else {
             // Parent process
             close(client_socket);
@@ -1,3 +1,5 @@
+// Build: gcc server.c -o server -pthread -lz [-DHAVE_ZSTD -lzstd] [-DHAVE_LZ4 -llz4]
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,10 +18,37 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <limits.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/sockios.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #define PORT 9002
 #define BUFFER_SIZE 1024
 #define FILE_TRANSFER_PORT 9003
+#define EVENT_LOOPS 2
+#define QUERY_THREADS 2
+#define DEQUE_CAPACITY 256
+#define MAX_EVENTS 64
 
 struct tar_header {
     char name[100];
@@ -38,35 +67,408 @@ struct tar_header {
     char devmajor[8];
     char devminor[8];
     char prefix[155];
-    // ...
+    char padding[12];
 };
 
-void processclient(int client_socket, pid_t pro_id);
+struct client_conn;
 
+void processclient(struct client_conn *conn);
+double elapsed_ms(const struct timespec *start);
+
+// Send the whole buffer, waiting for the socket to drain when it is non-blocking
+int send_all(int socket, const void *buffer, size_t length) {
+    const char *data = buffer;
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {.fd = socket, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// ---------------------------------------- I/O backends ----------------------------------------
+
+#define URING_ENTRIES 64
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE (64 * 1024)
+
+enum io_backend {
+    IO_BACKEND_SYNC,
+    IO_BACKEND_URING
+};
+
+static enum io_backend io_backend = IO_BACKEND_SYNC;
+
+// Minimal io_uring over the raw syscalls: one ring per thread, with a set of registered
+// buffers that file reads land in and socket writes go out of
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *buffers;
+};
+
+static __thread struct uring *thread_ring;
+static __thread int thread_ring_failed;
+
+int uring_setup(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Register the staging buffers once so reads and writes skip the per-call page pinning
+    ring->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    struct iovec iovecs[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iovecs[i].iov_base = ring->buffers + (size_t) i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// The calling thread's ring, created on first use; NULL means use the synchronous path
+struct uring *uring_for_thread(void) {
+    if (io_backend != IO_BACKEND_URING || thread_ring_failed) {
+        return NULL;
+    }
+    if (thread_ring == NULL) {
+        struct uring *ring = calloc(1, sizeof(*ring));
+        if (ring == NULL || uring_setup(ring, URING_ENTRIES) < 0) {
+            perror("Error setting up io_uring, falling back to synchronous I/O");
+            free(ring);
+            thread_ring_failed = 1;
+            return NULL;
+        }
+        thread_ring = ring;
+    }
+    return thread_ring;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Publish queued entries and wait for at least wait_nr completions, all in one syscall
+int uring_submit(struct uring *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int result;
+    do {
+        result = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                               wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+// Take the next completion, waiting for one if none is ready yet
+int uring_next_completion(struct uring *ring, struct io_uring_cqe *cqe) {
+    while (1) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (uring_submit(ring, 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+int sync_send_file(int socket, int fd, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t sent = sendfile(socket, fd, &offset, length);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {.fd = socket, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            // The file is shorter than the caller said
+            return -1;
+        }
+        length -= sent;
+    }
+    return 0;
+}
+
+// Queue the range as one linked chain read0 -> send0 -> read1 -> send1 ... through the
+// registered buffers, URING_BUFFERS chunks per io_uring_enter()
+int uring_send_file(struct uring *ring, int socket, int fd, off_t offset, size_t length) {
+    while (length > 0) {
+        size_t chunk_lengths[URING_BUFFERS];
+        struct io_uring_sqe *last_send = NULL;
+        int chunks = 0;
+        off_t batch_offset = offset;
+        for (; chunks < URING_BUFFERS && length > 0; chunks++) {
+            size_t chunk = length < URING_BUFFER_SIZE ? length : URING_BUFFER_SIZE;
+            char *buffer = ring->buffers + (size_t) chunks * URING_BUFFER_SIZE;
+            struct io_uring_sqe *read_sqe = uring_sqe(ring);
+            struct io_uring_sqe *send_sqe = uring_sqe(ring);
+            read_sqe->opcode = IORING_OP_READ_FIXED;
+            read_sqe->fd = fd;
+            read_sqe->addr = (unsigned long) buffer;
+            read_sqe->len = chunk;
+            read_sqe->off = offset;
+            read_sqe->buf_index = chunks;
+            read_sqe->flags = IOSQE_IO_LINK;
+            send_sqe->opcode = IORING_OP_WRITE_FIXED;
+            send_sqe->fd = socket;
+            send_sqe->addr = (unsigned long) buffer;
+            send_sqe->len = chunk;
+            send_sqe->buf_index = chunks;
+            send_sqe->flags = IOSQE_IO_LINK;
+            send_sqe->user_data = chunks + 1;
+            last_send = send_sqe;
+            chunk_lengths[chunks] = chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+        // The pairs form one chain so the socket sees the chunks in file order
+        last_send->flags = 0;
+
+        if (uring_submit(ring, 2 * chunks) < 0) {
+            return -1;
+        }
+
+        // Sends complete in order; everything after the first short or failed one is resent
+        size_t delivered = 0;
+        int broken = 0;
+        for (int i = 0; i < 2 * chunks; i++) {
+            struct io_uring_cqe cqe;
+            if (uring_next_completion(ring, &cqe) < 0) {
+                return -1;
+            }
+            if (cqe.user_data == 0) {
+                broken |= cqe.res < 0;
+                continue;
+            }
+            size_t expected = chunk_lengths[cqe.user_data - 1];
+            if (!broken && cqe.res == (int) expected) {
+                delivered += expected;
+            } else {
+                if (!broken && cqe.res > 0) {
+                    delivered += cqe.res;
+                }
+                broken = 1;
+            }
+        }
+        if (broken) {
+            off_t resume = batch_offset + delivered;
+            return sync_send_file(socket, fd, resume, (size_t) (offset - resume) + length);
+        }
+    }
+    return 0;
+}
+
+// Send length bytes of fd starting at offset through whichever backend is selected
+int send_file_range(int socket, int fd, off_t offset, size_t length) {
+    struct uring *ring = uring_for_thread();
+    if (ring != NULL) {
+        return uring_send_file(ring, socket, fd, offset, length);
+    }
+    return sync_send_file(socket, fd, offset, length);
+}
 
 // Function to transfer a file from server to client
 int transfer_file(int client_socket, const char *filename, int is_upload) {
 
     // Open the file
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
         perror("Error opening file");
         return -1;
     }
 
-    // Read and send the file data
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
-    }
+    // Send the file data
+    struct stat stat_buf;
+    int status = fstat(fd, &stat_buf) == 0 ? send_file_range(client_socket, fd, 0, stat_buf.st_size) : -1;
+
+    // Close the file
+    close(fd);
+
+    return status;
+}
+
+// ---------------------------------------- framing ----------------------------------------
+
+// Everything on a client connection travels in frames: a 12-byte header in network byte order
+// (version, type, flags, request id, payload length), then the payload. A command is one
+// FRAME_COMMAND. Its reply is any number of FRAME_ARCHIVE chunks closed by a FRAME_ARCHIVE_END
+// when there is an archive, then one FRAME_RESPONSE with the text. Every frame of a reply carries
+// the request id of the command it answers.
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum frame_type {
+    FRAME_COMMAND = 1,
+    FRAME_ARCHIVE = 2,
+    FRAME_ARCHIVE_END = 3,
+    FRAME_RESPONSE = 4
+};
+
+// On FRAME_ARCHIVE_END: the archive was cut short. On FRAME_RESPONSE: the command was refused.
+#define FRAME_FLAG_ERROR 0x1
+
+struct frame_header {
+    unsigned char version;
+    unsigned char type;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t length;
+};
 
-    // Close the file and file transfer socket
-    fclose(file);
+void frame_header_pack(unsigned char *bytes, int type, int flags, uint32_t request_id, size_t length) {
+    uint16_t net_flags = htons((uint16_t) flags);
+    uint32_t net_request_id = htonl(request_id);
+    uint32_t net_length = htonl((uint32_t) length);
+    bytes[0] = FRAME_VERSION;
+    bytes[1] = (unsigned char) type;
+    memcpy(bytes + 2, &net_flags, sizeof(net_flags));
+    memcpy(bytes + 4, &net_request_id, sizeof(net_request_id));
+    memcpy(bytes + 8, &net_length, sizeof(net_length));
+}
+
+// Returns -1 for a header of another version or with an oversized payload
+int frame_header_unpack(const unsigned char *bytes, struct frame_header *header) {
+    uint16_t net_flags;
+    uint32_t net_request_id;
+    uint32_t net_length;
+    memcpy(&net_flags, bytes + 2, sizeof(net_flags));
+    memcpy(&net_request_id, bytes + 4, sizeof(net_request_id));
+    memcpy(&net_length, bytes + 8, sizeof(net_length));
+    header->version = bytes[0];
+    header->type = bytes[1];
+    header->flags = ntohs(net_flags);
+    header->request_id = ntohl(net_request_id);
+    header->length = ntohl(net_length);
+    return header->version == FRAME_VERSION && header->length <= FRAME_MAX_PAYLOAD ? 0 : -1;
+}
+
+// Send a frame header; the caller sends exactly length bytes of payload after it
+int send_frame_header(int socket, int type, int flags, uint32_t request_id, size_t length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    frame_header_pack(header, type, flags, request_id, length);
+    return send_all(socket, header, sizeof(header));
+}
+
+// Send a whole frame; a small payload goes out in the same send as its header
+int send_frame(int socket, int type, int flags, uint32_t request_id, const void *payload, size_t length) {
+    if (length > BUFFER_SIZE) {
+        if (send_frame_header(socket, type, flags, request_id, length) == -1) {
+            return -1;
+        }
+        return send_all(socket, payload, length);
+    }
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    frame_header_pack(frame, type, flags, request_id, length);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    return send_all(socket, frame, FRAME_HEADER_SIZE + length);
+}
 
+// Read exactly length bytes from a blocking socket; returns 0 on success, -1 on error or close
+int recv_all(int socket, void *buffer, size_t length) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t received = recv(socket, bytes, length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        bytes += received;
+        length -= received;
+    }
     return 0;
 }
 
+// Read one frame from a blocking socket into payload, which holds capacity bytes
+int recv_frame(int socket, struct frame_header *header, void *payload, size_t capacity) {
+    unsigned char bytes[FRAME_HEADER_SIZE];
+    if (recv_all(socket, bytes, sizeof(bytes)) != 0 || frame_header_unpack(bytes, header) != 0 ||
+        header->length > capacity) {
+        return -1;
+    }
+    return recv_all(socket, payload, header->length);
+}
+
+// Where a command's reply goes: the client's socket, tagged with the command's request id
+struct reply_channel {
+    int socket;
+    uint32_t request_id;
+};
+
 // ------------------------------------- validate_command -------------------------------
 
 int is_valid_date_format(const char *date_str) {
@@ -196,748 +598,5515 @@ int validate_command(char *command) {
     return 1;
 }
 
-// -------------------------- handle_fgets_command ------------------------
+// -------------------------------------- tar writer --------------------------------------
 
-// Function to add a file to a tar archive
-void add_file_to_tar(const char *tar_filename, const char *file_path, int *flag, char *response) {
-    char command[256];
-    snprintf(command, sizeof(command), "tar --append --file=%s %s", tar_filename, file_path);
-    if (system(command) != 0) {
-        sprintf(response, "Error creating TAR archive");
-        printf("file not found");
-        *flag = 0;
-        return;
-    }
-}
+#define TAR_BLOCK_SIZE 512
+#define TAR_COPY_BUFFER (64 * 1024)
+#define PAX_HEADER_TYPE 'x'
 
-void search_and_add_file(const char *current_directory, const char *target_file,
-                         const char *tar_name, int *flag, char *response) {
+// Anything the archive is streamed into; write returns 0 once all bytes are accepted
+struct archive_sink {
+    int (*write)(struct archive_sink *sink, const void *data, size_t length);
+};
 
-    DIR *dir = opendir(current_directory);
-    if (dir == NULL) {
-        fprintf(stderr, "Unable to open directory '%s': %s\n", current_directory, strerror(errno));
-        return;
-    }
+struct file_sink {
+    struct archive_sink base;
+    FILE *file;
+};
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+int file_sink_write(struct archive_sink *sink, const void *data, size_t length) {
+    FILE *file = ((struct file_sink *) sink)->file;
+    return fwrite(data, 1, length, file) == length ? 0 : -1;
+}
 
-        char file_path[PATH_MAX];
-        snprintf(file_path, sizeof(file_path), "%s/%s", current_directory, entry->d_name);
+void file_sink_init(struct file_sink *sink, FILE *file) {
+    sink->base.write = file_sink_write;
+    sink->file = file;
+}
 
-        struct stat file_stat;
-        if (stat(file_path, &file_stat) != 0) {
-            fprintf(stderr, "File '%s' not found: %s\n", file_path, strerror(errno));
-            printf("not found");
-            *flag = 0;
-            continue;
-        }
+// Zero-filled octal number, NUL terminated, as ustar expects
+void tar_octal(char *field, size_t width, unsigned long long value) {
+    snprintf(field, width, "%0*llo", (int) width - 1, value);
+}
+
+int tar_write_padding(struct archive_sink *sink, unsigned long long length) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t padding = (TAR_BLOCK_SIZE - length % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    return padding > 0 ? sink->write(sink, zeros, padding) : 0;
+}
 
-        if (S_ISREG(file_stat.st_mode) && strcmp(entry->d_name, target_file) == 0) {
-            // Add the file to the tar archive
-            add_file_to_tar(tar_name, file_path, flag, response);
-        } else if (S_ISDIR(file_stat.st_mode)) {
-            // Recursively search in subdirectory
-            search_and_add_file(file_path, target_file, tar_name, flag, response);
+int tar_write_header(struct archive_sink *sink, struct tar_header *header) {
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    unsigned int sum = 0;
+    const unsigned char *bytes = (const unsigned char *) header;
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+    return sink->write(sink, header, sizeof(*header));
+}
+
+// Split a path into ustar prefix and name; returns -1 when it does not fit
+int tar_split_name(struct tar_header *header, const char *path) {
+    size_t length = strlen(path);
+    if (length <= sizeof(header->name)) {
+        memcpy(header->name, path, length);
+        return 0;
+    }
+    for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t prefix_length = slash - path;
+        size_t name_length = length - prefix_length - 1;
+        if (prefix_length <= sizeof(header->prefix) && name_length <= sizeof(header->name) && name_length > 0) {
+            memcpy(header->prefix, path, prefix_length);
+            memcpy(header->name, slash + 1, name_length);
+            return 0;
         }
     }
+    return -1;
+}
 
-    closedir(dir);
+void tar_fill_header(struct tar_header *header, const char *name, const struct stat *file_stat,
+                     unsigned long long size, char typeflag) {
+    memset(header, 0, sizeof(*header));
+    tar_octal(header->mode, sizeof(header->mode), file_stat->st_mode & 07777);
+    tar_octal(header->uid, sizeof(header->uid), file_stat->st_uid & 07777777);
+    tar_octal(header->gid, sizeof(header->gid), file_stat->st_gid & 07777777);
+    tar_octal(header->size, sizeof(header->size), size);
+    tar_octal(header->mtime, sizeof(header->mtime), (unsigned long long) file_stat->st_mtime);
+    header->typeflag[0] = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    if (name != NULL && tar_split_name(header, name) < 0) {
+        // Cut short on purpose: the pax record ahead of this header carries the full name
+        size_t length = strnlen(name, sizeof(header->name));
+        memcpy(header->name, name, length);
+    }
 }
 
-void search_files(const char *files[], int num_files, const char *tar_name, int *flag, char *response) {
-    const char *root_directory = getenv("HOME");
-    strcat(root_directory, "/");
-    for (int i = 0; i < num_files; i++) {
-        search_and_add_file(root_directory, files[i], tar_name, flag, response);
+// One "<length> key=value\n" pax record; the length counts its own digits
+size_t pax_record(char *out, size_t room, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t length = body + 1;
+    while (length != body + (size_t) snprintf(NULL, 0, "%zu", length)) {
+        length = body + snprintf(NULL, 0, "%zu", length);
     }
+    return (size_t) snprintf(out, room, "%zu %s=%s\n", length, key, value);
 }
 
-// void send_tar_file(const char *filename, int client_socket) {
-//     int fd = open(filename, O_RDONLY);
-//     if (fd == -1) {
-//         perror("Error opening file");
-//         return;
-//     }
+// Write header and body of one regular file; paths or sizes ustar cannot hold get a pax header
+int tar_write_file(struct archive_sink *sink, const char *file_path) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    // Member names are relative, the way tar itself stores absolute paths
+    const char *name = file_path;
+    while (*name == '/') {
+        name++;
+    }
+    unsigned long long size = (unsigned long long) file_stat.st_size;
+
+    struct tar_header header;
+    int needs_pax = size > 077777777777ULL || tar_split_name(&header, name) < 0;
+    if (needs_pax) {
+        char records[PATH_MAX + 128];
+        char size_text[32];
+        size_t records_length = pax_record(records, sizeof(records), "path", name);
+        snprintf(size_text, sizeof(size_text), "%llu", size);
+        records_length += pax_record(records + records_length, sizeof(records) - records_length, "size", size_text);
+
+        tar_fill_header(&header, "PaxHeaders/entry", &file_stat, records_length, PAX_HEADER_TYPE);
+        if (tar_write_header(sink, &header) < 0 || sink->write(sink, records, records_length) < 0 ||
+            tar_write_padding(sink, records_length) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
 
-//     struct stat stat_buf;
-//     if (fstat(fd, &stat_buf) != 0) {
-//         perror("Error getting file size");
-//         close(fd);
-//         return;
-//     }
+    tar_fill_header(&header, name, &file_stat, size > 077777777777ULL ? 0 : size, REGTYPE);
+    if (tar_write_header(sink, &header) < 0) {
+        close(fd);
+        return -1;
+    }
 
-//     // Send the file size to the client
-//     off_t file_size = stat_buf.st_size;
-//     printf("%ld\n", file_size);
-//     if (send(client_socket, &file_size, sizeof(off_t), 0) == -1) {
-//         perror("Error sending file size");
-//         close(fd);
-//         return;
-//     }
+    // Stream the body; a file that shrank meanwhile is zero-filled to the size in its header
+    char *buffer = malloc(TAR_COPY_BUFFER);
+    unsigned long long remaining = size;
+    int status = buffer != NULL ? 0 : -1;
+    while (status == 0 && remaining > 0) {
+        size_t want = remaining < TAR_COPY_BUFFER ? remaining : TAR_COPY_BUFFER;
+        ssize_t got = read(fd, buffer, want);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            memset(buffer, 0, want);
+            got = want;
+        }
+        status = sink->write(sink, buffer, got);
+        remaining -= got;
+    }
+    free(buffer);
+    close(fd);
 
-//     // Send the file data using the sendfile() function
-//     off_t offset = 0;
-//     ssize_t sent_bytes = sendfile(client_socket, fd, &offset, stat_buf.st_size);
-//     if (sent_bytes == -1) {
-//         perror("Error sending file data");
-//         close(fd);
-//         return;
-//     }
+    return status == 0 ? tar_write_padding(sink, size) : -1;
+}
 
-//     printf("Sent %zd bytes of file data\n", sent_bytes);
+// End-of-archive marker: two zero blocks
+int tar_finish(struct archive_sink *sink) {
+    static const char zeros[2 * TAR_BLOCK_SIZE];
+    return sink->write(sink, zeros, sizeof(zeros));
+}
 
-//     close(fd);
-// }
+// ------------------------------------ parallel gzip ------------------------------------
+
+#define GZIP_BLOCK_SIZE (128 * 1024)
+#define GZIP_WINDOW (32 * 1024)
+#define GZIP_LEVELS 10
+#define RATE_ALPHA 0.3
+#define MIN_RATE_SAMPLE (16 * 1024)
+
+// One slice of the tar stream, deflated on its own thread. Each block is primed with the last
+// 32KB of the previous one and ends on a sync flush, so the outputs concatenate into a single
+// deflate stream and compress nearly as well as a serial gzip. Blocks may use different levels.
+struct gzip_block {
+    unsigned char *input;
+    size_t input_length;
+    unsigned char dictionary[GZIP_WINDOW];
+    size_t dictionary_length;
+    int level;
+    int last;
+    unsigned char *output;
+    size_t output_length;
+    unsigned long crc;
+    int failed;
+    int done;
+    struct gzip_block *next_job;
+    struct gzip_block *next_pending;
+};
 
-void send_tar_file(const char *file_path, int socket) {
-    printf("file_path :: => :: %s\n", file_path);
-    printf("socket :: => :: %d\n", socket);
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL) {
-        perror("Error opening TAR file");
-        return;
-    }
+#define LINK_BACKLOG (128 * 1024)
+#define LINK_SAMPLE_MS 5.0
+
+// Send throughput of one connection. Bytes that left the socket queue (sent minus SIOCOUTQ) over
+// time give the drain rate, which is the link's rate only while data is backed up in the queue;
+// with an empty queue the link is keeping up with us and is not the bottleneck.
+struct link_meter {
+    int socket;
+    int sampled;
+    int backlogged;
+    int rated;
+    unsigned long long sent;
+    unsigned long long drained;
+    struct timespec last_sample;
+    double bytes_per_second;
+};
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+void link_meter_init(struct link_meter *meter, int socket) {
+    memset(meter, 0, sizeof(*meter));
+    meter->socket = socket;
+}
 
-    if (send(socket, &file_size, sizeof(file_size), 0) == -1) {
-        perror("Error sending file size");
-        fclose(file);
+void link_meter_record(struct link_meter *meter, size_t length) {
+    int queued;
+    meter->sent += length;
+    if (ioctl(meter->socket, SIOCOUTQ, &queued) != 0) {
         return;
     }
-    printf("%ld\n", file_size);
-
-    char *buffer = (char *)malloc(file_size);
-    if (buffer == NULL) {
-        perror("Memory allocation error");
-        fclose(file);
+    unsigned long long drained = meter->sent - (unsigned long long) queued;
+    if (meter->last_sample.tv_sec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &meter->last_sample);
+        meter->drained = drained;
         return;
     }
-
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    if (bytes_read != file_size) {
-        perror("Error reading TAR file");
-        free(buffer);
-        fclose(file);
+    double ms = elapsed_ms(&meter->last_sample);
+    if (ms < LINK_SAMPLE_MS) {
         return;
     }
 
-    if (send(socket, buffer, file_size, 0) == -1) {
-        perror("Error sending TAR file");
+    meter->backlogged = queued >= LINK_BACKLOG;
+    if (meter->backlogged) {
+        double rate = (drained - meter->drained) / (ms / 1000.0);
+        meter->bytes_per_second = meter->rated ? RATE_ALPHA * rate + (1 - RATE_ALPHA) * meter->bytes_per_second : rate;
+        meter->rated = 1;
     }
-
-    free(buffer);
-    fclose(file);
+    meter->sampled = 1;
+    meter->drained = drained;
+    clock_gettime(CLOCK_MONOTONIC, &meter->last_sample);
 }
 
+struct gzip_sink {
+    struct archive_sink base;
+    struct archive_sink *out;
+    int level;
+    // Adaptive mode picks each block's level from link and compressor throughput
+    const struct link_meter *link;
+    int adaptive;
+    double ratios[GZIP_LEVELS];
+    int ratio_seen[GZIP_LEVELS];
+    unsigned char *input;
+    size_t input_length;
+    unsigned char dictionary[GZIP_WINDOW];
+    size_t dictionary_length;
+    struct gzip_block *pending_head;
+    struct gzip_block *pending_tail;
+    int in_flight;
+    unsigned long crc;
+    unsigned long long total_length;
+    int failed;
+};
 
-void handle_fgets_command(char *arguments, char *response, pid_t pro_id, int client_socket) {
-    // Tokenize the space-separated file names from the arguments
-    char *file_name = strtok(arguments, " ");
-    char *files[4]; // Assuming the maximum of 4 files in fgets command
-    int num_files = 0;
-    int start_flag = 1;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    struct gzip_block *head;
+    struct gzip_block *tail;
+    int num_threads;
+    double rates[GZIP_LEVELS]; // input bytes per second of one thread, per level
+} compress_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
 
-    while (file_name != NULL && num_files < 4) {
-        printf("%s\n", file_name);
-        files[num_files] = file_name;
-        num_files++;
-        file_name = strtok(NULL, " ");
+void deflate_block(struct gzip_block *block) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    block->crc = crc32(0L, block->input, block->input_length);
+    if (deflateInit2(&stream, block->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        block->failed = 1;
+        return;
+    }
+    if (block->dictionary_length > 0) {
+        deflateSetDictionary(&stream, block->dictionary, block->dictionary_length);
     }
 
-    if (num_files == 0) {
-        // No files specified in the command
-        sprintf(response, "No files specified");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
+    // Room for the worst case plus the sync flush marker
+    size_t capacity = deflateBound(&stream, block->input_length) + 64;
+    block->output = malloc(capacity);
+    if (block->output == NULL) {
+        deflateEnd(&stream);
+        block->failed = 1;
         return;
-    } else {
-        // Create the directory if it doesn't exist
-        char dir_name[PATH_MAX];
-        snprintf(dir_name, sizeof(dir_name), "%d", pro_id);
-        if (mkdir(dir_name, 0777) != 0 && errno != EEXIST) {
-            perror("Error creating directory");
-            sprintf(response, "Error creating directory");
-            start_flag = 0;
-            send(client_socket, &start_flag, sizeof(int), 0);
-            return;
-        }
-
-        // Create the tar archive within the directory
-        char tar_name[PATH_MAX];
-        snprintf(tar_name, sizeof(tar_name), "%s/%s", dir_name, "temp.tar.gz");
-        remove(tar_name); // previous temp tar file deleting
-        search_files(files, num_files, tar_name, &start_flag, response); // Uncomment and implement this function
+    }
+    stream.next_in = block->input;
+    stream.avail_in = block->input_length;
+    stream.next_out = block->output;
+    stream.avail_out = capacity;
+    int status = deflate(&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((block->last && status != Z_STREAM_END) || (!block->last && (status != Z_OK || stream.avail_in != 0))) {
+        block->failed = 1;
+    }
+    block->output_length = capacity - stream.avail_out;
+    deflateEnd(&stream);
+}
 
-        // Check if the file exists
-        if (access(tar_name, F_OK) != -1) {
-            start_flag = 1;
-        } else {
-            start_flag = 0;
+void *compress_worker_main(void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&compress_pool.lock);
+        while (compress_pool.head == NULL) {
+            pthread_cond_wait(&compress_pool.ready, &compress_pool.lock);
         }
-
-        if (start_flag == 1) {
-            sprintf(response, "Tar archive created: %s", tar_name);
-            send(client_socket, &start_flag, sizeof(int), 0);
-            send_tar_file(tar_name, client_socket);
-        } else {
-            send(client_socket, &start_flag, sizeof(int), 0);
-            sprintf(response, "No file found");
+        struct gzip_block *block = compress_pool.head;
+        compress_pool.head = block->next_job;
+        if (compress_pool.head == NULL) {
+            compress_pool.tail = NULL;
         }
+        pthread_mutex_unlock(&compress_pool.lock);
 
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        deflate_block(block);
+        double ms = elapsed_ms(&started);
 
+        pthread_mutex_lock(&compress_pool.lock);
+        if (block->input_length >= MIN_RATE_SAMPLE && ms > 0) {
+            double rate = block->input_length / (ms / 1000.0);
+            compress_pool.rates[block->level] = RATE_ALPHA * rate + (1 - RATE_ALPHA) * compress_pool.rates[block->level];
+        }
+        block->done = 1;
+        pthread_cond_broadcast(&compress_pool.done);
+        pthread_mutex_unlock(&compress_pool.lock);
     }
+    return NULL;
 }
 
-// ----------------------------handle_tarfgetz_command------------------------------------
-
-void handle_tarfgetz_command(char *arguments, char *response, pid_t pro_id, int client_socket) {
-    // Tokenize the space-separated arguments
-    char *size1_str = strtok(arguments, " ");
-    char *size2_str = strtok(NULL, " ");
-    char *unzip_flag = strtok(NULL, " ");
-    int start_flag = 1;
-
-    if (size1_str == NULL || size2_str == NULL) {
-        sprintf(response, "Invalid arguments");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+void start_compress_pool(int num_threads) {
+    compress_pool.num_threads = num_threads;
+    // Rough per-thread starting points until real blocks have been timed
+    for (int level = 0; level < GZIP_LEVELS; level++) {
+        compress_pool.rates[level] = level == 0 ? 1e9 : level <= 3 ? 60e6 : level <= 6 ? 25e6 : 8e6;
     }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compress_worker_main, NULL) != 0) {
+            perror("Error starting compression thread");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
 
-    // Convert size1 and size2 to integers
-    int size1 = atoi(size1_str);
-    int size2 = atoi(size2_str);
+// Wait for the oldest block, append its output to the stream and fold in its CRC
+int gzip_retire_block(struct gzip_sink *sink) {
+    struct gzip_block *block = sink->pending_head;
+    pthread_mutex_lock(&compress_pool.lock);
+    while (!block->done) {
+        pthread_cond_wait(&compress_pool.done, &compress_pool.lock);
+    }
+    pthread_mutex_unlock(&compress_pool.lock);
 
-    if (size1 < 0 || size2 < 0 || size1 > size2) {
-        sprintf(response, "Invalid size criteria");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+    sink->pending_head = block->next_pending;
+    if (sink->pending_head == NULL) {
+        sink->pending_tail = NULL;
     }
+    sink->in_flight--;
 
-    // Get the user's home directory
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        sprintf(response, "Unable to get home directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+    if (block->failed || sink->out->write(sink->out, block->output, block->output_length) != 0) {
+        sink->failed = 1;
     }
+    if (block->input_length >= MIN_RATE_SAMPLE) {
+        double ratio = (double) block->output_length / block->input_length;
+        int level = block->level;
+        sink->ratios[level] = sink->ratio_seen[level] ? RATE_ALPHA * ratio + (1 - RATE_ALPHA) * sink->ratios[level]
+                                                      : ratio;
+        sink->ratio_seen[level] = 1;
+    }
+    sink->crc = crc32_combine(sink->crc, block->crc, block->input_length);
+    free(block->output);
+    free(block->input);
+    free(block);
+    return sink->failed ? -1 : 0;
+}
 
-    // Create a temporary TAR file name
-    char tar_name[PATH_MAX];
+#define ADAPTIVE_FAST 1
+#define ADAPTIVE_STRONG 9
 
+// Typical output/input ratios, used to scale a measured ratio to levels not tried yet
+static const double default_ratios[GZIP_LEVELS] = {1.0, 0.38, 0.37, 0.36, 0.35, 0.34, 0.335, 0.333, 0.332, 0.33};
 
-    // Create the directory if it doesn't exist
-    char dir_name[PATH_MAX];
-    snprintf(dir_name, sizeof(dir_name), "%d", pro_id);
-    if (mkdir(dir_name, 0777) != 0 && errno != EEXIST) {
-        sprintf(response, "Error creating directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+double gzip_expected_ratio(const struct gzip_sink *sink, int level) {
+    if (sink->ratio_seen[level] || level == 0) {
+        return sink->ratio_seen[level] ? sink->ratios[level] : 1.0;
     }
-
-    // Use the find command to write the list of files to the file
-    char find_command[256];
-    snprintf(find_command, sizeof(find_command), "find ~ -type f -size +%dk -a -size -%dk > %d/file_list.txt", size1,
-             size2, pro_id);
-    if (system(find_command) != 0) {
-        sprintf(response, "No files found");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+    for (int seen = 1; seen < GZIP_LEVELS; seen++) {
+        if (sink->ratio_seen[seen]) {
+            double ratio = sink->ratios[seen] * default_ratios[level] / default_ratios[seen];
+            return ratio < 1.0 ? ratio : 1.0;
+        }
     }
+    return default_ratios[level];
+}
 
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%d/file_list.txt", pro_id);
-    // Open the file in binary read mode
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("Error opening file");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+// Pick the level that moves input fastest: each is capped by either the link (after compression)
+// or the compression threads, whichever is slower
+int gzip_pick_level(const struct gzip_sink *sink) {
+    static const int candidates[] = {0, ADAPTIVE_FAST, ADAPTIVE_STRONG};
+    if (sink->link == NULL || !sink->link->sampled) {
+        return ADAPTIVE_FAST; // nothing measured yet
     }
+    if (!sink->link->backlogged) {
+        return 0; // the link keeps up with uncompressed data, so compressing only costs CPU
+    }
+    double link = sink->link->bytes_per_second > 1 ? sink->link->bytes_per_second : 1;
+
+    int best_level = ADAPTIVE_FAST;
+    double best_rate = 0;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        int level = candidates[i];
+        pthread_mutex_lock(&compress_pool.lock);
+        double compress = compress_pool.rates[level] * compress_pool.num_threads;
+        pthread_mutex_unlock(&compress_pool.lock);
+        double send = link / gzip_expected_ratio(sink, level);
+        double rate = send < compress ? send : compress;
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_level = level;
+        }
+    }
+    return best_level;
+}
 
-    // Seek to the end of the file
-    fseek(file, 0, SEEK_END);
-
-    // Get the current position (which is the size of the file)
-    long file_size = ftell(file);
-
-    if (file_size == 0) {
-        sprintf(response, "No files found");
-        start_flag = 0;
-        printf("not found");
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+int gzip_queue_block(struct gzip_sink *sink, int last) {
+    struct gzip_block *block = calloc(1, sizeof(*block));
+    if (block == NULL) {
+        return -1;
+    }
+    block->input = sink->input;
+    block->input_length = sink->input_length;
+    block->level = sink->adaptive ? gzip_pick_level(sink) : sink->level;
+    block->last = last;
+    memcpy(block->dictionary, sink->dictionary, sink->dictionary_length);
+    block->dictionary_length = sink->dictionary_length;
+
+    // The tail of this block primes the next one
+    size_t keep = block->input_length < GZIP_WINDOW ? block->input_length : GZIP_WINDOW;
+    if (keep == GZIP_WINDOW) {
+        memcpy(sink->dictionary, block->input + block->input_length - keep, keep);
+    } else {
+        size_t carried = sink->dictionary_length + keep > GZIP_WINDOW ? GZIP_WINDOW - keep : sink->dictionary_length;
+        memmove(sink->dictionary, sink->dictionary + sink->dictionary_length - carried, carried);
+        memcpy(sink->dictionary + carried, block->input + block->input_length - keep, keep);
+        keep += carried;
     }
+    sink->dictionary_length = keep;
+    sink->total_length += block->input_length;
+    sink->input = NULL;
+    sink->input_length = 0;
 
-    // Close the file
-    fclose(file);
+    if (sink->pending_tail != NULL) {
+        sink->pending_tail->next_pending = block;
+    } else {
+        sink->pending_head = block;
+    }
+    sink->pending_tail = block;
+    sink->in_flight++;
 
+    pthread_mutex_lock(&compress_pool.lock);
+    if (compress_pool.tail != NULL) {
+        compress_pool.tail->next_job = block;
+    } else {
+        compress_pool.head = block;
+    }
+    compress_pool.tail = block;
+    pthread_cond_signal(&compress_pool.ready);
+    pthread_mutex_unlock(&compress_pool.lock);
+
+    // Bound memory: keep at most two blocks per compression thread in flight
+    while (sink->in_flight > 2 * compress_pool.num_threads) {
+        if (gzip_retire_block(sink) != 0) {
+            return -1;
+        }
+    }
 
-    // Create the TAR archive using the file list
-    char tar_command[256];
+    // Pass on blocks that are already compressed so output trails input by as little as possible
+    while (sink->pending_head != NULL) {
+        pthread_mutex_lock(&compress_pool.lock);
+        int done = sink->pending_head->done;
+        pthread_mutex_unlock(&compress_pool.lock);
+        if (!done) {
+            break;
+        }
+        if (gzip_retire_block(sink) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    snprintf(tar_name, sizeof(tar_name), "%s/%s", dir_name, "temp.tar.gz");
-    remove(tar_name); // previous temp tar file deleting
+int gzip_sink_write(struct archive_sink *base, const void *data, size_t length) {
+    struct gzip_sink *sink = (struct gzip_sink *) base;
+    const unsigned char *bytes = data;
+    while (length > 0 && !sink->failed) {
+        if (sink->input == NULL && (sink->input = malloc(GZIP_BLOCK_SIZE)) == NULL) {
+            return -1;
+        }
+        size_t room = GZIP_BLOCK_SIZE - sink->input_length;
+        size_t take = length < room ? length : room;
+        memcpy(sink->input + sink->input_length, bytes, take);
+        sink->input_length += take;
+        bytes += take;
+        length -= take;
+        if (sink->input_length == GZIP_BLOCK_SIZE && gzip_queue_block(sink, 0) != 0) {
+            return -1;
+        }
+    }
+    return sink->failed ? -1 : 0;
+}
 
-    snprintf(tar_command, sizeof(tar_command), "tar czf %s -T %d/file_list.txt", tar_name, pro_id);
-    if (system(tar_command) != 0) {
-        sprintf(response, "Error creating TAR archive");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+int gzip_sink_init(struct gzip_sink *sink, struct archive_sink *out, int level) {
+    // Fixed gzip header: deflate, no name, no mtime, unknown OS
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+    memset(sink, 0, sizeof(*sink));
+    sink->base.write = gzip_sink_write;
+    sink->out = out;
+    sink->level = level;
+    sink->crc = crc32(0L, Z_NULL, 0);
+    if (out->write(out, header, sizeof(header)) != 0) {
+        sink->failed = 1;
+        return -1;
     }
+    return 0;
+}
 
-    // Check if the -u flag is specified for unzipping
-    if (unzip_flag != NULL && strcmp(unzip_flag, "-u") == 0) {
-        // Send the TAR archive to the client for unzipping
-        // send_tar_file(tar_name, client_socket);
+// Flush the final block and write the CRC32/ISIZE trailer
+int gzip_sink_finish(struct gzip_sink *sink) {
+    if (!sink->failed && sink->input == NULL && (sink->input = malloc(1)) == NULL) {
+        sink->failed = 1;
+    }
+    if (!sink->failed && gzip_queue_block(sink, 1) != 0) {
+        sink->failed = 1;
+    }
+    while (sink->pending_head != NULL) {
+        gzip_retire_block(sink);
+    }
+    free(sink->input);
+    sink->input = NULL;
+    if (sink->failed) {
+        return -1;
     }
 
-    if (start_flag == 1) {
-        sprintf(response, "Tar archive created: %s", tar_name);
-        printf("sending response...\n");
-        send(client_socket, &start_flag, sizeof(int), 0);
-        send_tar_file(tar_name, client_socket);
-        printf("sending response...\n");
-        return;
-    } else {
-        sprintf(response, "No files found");
-        send(client_socket, &start_flag, sizeof(int), 0);
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (sink->crc >> (8 * i)) & 0xff;
+        trailer[4 + i] = (sink->total_length >> (8 * i)) & 0xff;
     }
+    return sink->out->write(sink->out, trailer, sizeof(trailer));
 }
 
-// ---------------------------------handle_filesrch_command---------------------------------
+// ---------------------------------------- codecs ----------------------------------------
 
-void format_creation_time(time_t ctime, char *formatted_time) {
-    struct tm *timeinfo;
-    timeinfo = localtime(&ctime);
-    strftime(formatted_time, 20, "%b %d %H:%M", timeinfo);
-}
+// Picked per request with "-c <codec>[:<level>]"; zstd and lz4 exist only when built in.
+// auto is gzip with each block's level chosen from measured throughput.
+enum codec_id {
+    CODEC_STORE,
+    CODEC_AUTO,
+    CODEC_GZIP,
+    CODEC_ZSTD,
+    CODEC_LZ4
+};
 
-void handle_filesrch_command(char *arguments, char *response, int client_socket) {
-    // Tokenize the command arguments to get the filename
-    int start_flag = 0;
-    char *filename = strtok(arguments, " ");
-    if (filename == NULL) {
+struct codec {
+    enum codec_id id;
+    const char *name;
+    int min_level;
+    int max_level;
+    int default_level;
+};
+
+static const struct codec codecs[] = {
+    {CODEC_STORE, "store", 0, 0, 0},
+    {CODEC_AUTO, "auto", 0, 0, 0},
+    {CODEC_GZIP, "gzip", 1, 9, 6},
+#ifdef HAVE_ZSTD
+    {CODEC_ZSTD, "zstd", 1, 19, 3},
+#endif
+#ifdef HAVE_LZ4
+    {CODEC_LZ4, "lz4", 0, 12, 0},
+#endif
+};
+
+int codec_default_level(enum codec_id id) {
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (codecs[i].id == id) {
+            return codecs[i].default_level;
+        }
+    }
+    return 0;
+}
+
+struct codec_choice {
+    enum codec_id id;
+    int level;
+};
+
+static const struct codec_choice default_codec = {CODEC_AUTO, 0};
+
+int parse_codec(const char *spec, struct codec_choice *choice) {
+    const char *colon = strchr(spec, ':');
+    size_t name_length = colon != NULL ? (size_t) (colon - spec) : strlen(spec);
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (strlen(codecs[i].name) != name_length || strncmp(codecs[i].name, spec, name_length) != 0) {
+            continue;
+        }
+        int level = codecs[i].default_level;
+        if (colon != NULL) {
+            char *end;
+            level = (int) strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || level < codecs[i].min_level || level > codecs[i].max_level) {
+                return -1;
+            }
+        }
+        choice->id = codecs[i].id;
+        choice->level = level;
+        return 0;
+    }
+    return -1;
+}
+
+// Pull "-c <codec>" and "-u" (send the archive uncompressed) out of the arguments so the command
+// handlers never see them
+int take_codec_option(char *arguments, struct codec_choice *choice) {
+    *choice = default_codec;
+    if (arguments == NULL) {
+        return 0;
+    }
+
+    char rest[BUFFER_SIZE + 1] = "";
+    char *saveptr = NULL;
+    int status = 0;
+    for (char *token = strtok_r(arguments, " ", &saveptr); token != NULL; token = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(token, "-c") == 0) {
+            char *spec = strtok_r(NULL, " ", &saveptr);
+            if (spec == NULL || parse_codec(spec, choice) != 0) {
+                status = -1;
+            }
+            continue;
+        }
+        if (strcmp(token, "-u") == 0) {
+            choice->id = CODEC_STORE;
+            choice->level = 0;
+            continue;
+        }
+        if (rest[0] != '\0') {
+            strcat(rest, " ");
+        }
+        strcat(rest, token);
+    }
+    strcpy(arguments, rest);
+    return status;
+}
+
+#ifdef HAVE_ZSTD
+struct zstd_sink {
+    struct archive_sink base;
+    struct archive_sink *out;
+    ZSTD_CCtx *context;
+    void *output;
+    size_t output_size;
+};
+
+// Compress what is given (or end the frame) and pass every produced byte on
+int zstd_sink_pump(struct zstd_sink *sink, const void *data, size_t length, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {data, length, 0};
+    size_t remaining;
+    do {
+        ZSTD_outBuffer output = {sink->output, sink->output_size, 0};
+        remaining = ZSTD_compressStream2(sink->context, &output, &input, mode);
+        if (ZSTD_isError(remaining)) {
+            return -1;
+        }
+        if (output.pos > 0 && sink->out->write(sink->out, sink->output, output.pos) != 0) {
+            return -1;
+        }
+    } while (mode == ZSTD_e_end ? remaining != 0 : input.pos < input.size);
+    return 0;
+}
+
+int zstd_sink_write(struct archive_sink *base, const void *data, size_t length) {
+    return zstd_sink_pump((struct zstd_sink *) base, data, length, ZSTD_e_continue);
+}
+
+int zstd_sink_init(struct zstd_sink *sink, struct archive_sink *out, int level) {
+    sink->base.write = zstd_sink_write;
+    sink->out = out;
+    sink->output_size = ZSTD_CStreamOutSize();
+    sink->output = malloc(sink->output_size);
+    sink->context = ZSTD_createCCtx();
+    if (sink->output == NULL || sink->context == NULL) {
+        return -1;
+    }
+    ZSTD_CCtx_setParameter(sink->context, ZSTD_c_compressionLevel, level);
+    // Uses zstd's own worker threads when the library was built with them; ignored otherwise
+    ZSTD_CCtx_setParameter(sink->context, ZSTD_c_nbWorkers, compress_pool.num_threads);
+    return 0;
+}
+
+int zstd_sink_finish(struct zstd_sink *sink) {
+    int status = sink->context != NULL ? zstd_sink_pump(sink, NULL, 0, ZSTD_e_end) : -1;
+    ZSTD_freeCCtx(sink->context);
+    free(sink->output);
+    return status;
+}
+#endif
+
+#ifdef HAVE_LZ4
+struct lz4_sink {
+    struct archive_sink base;
+    struct archive_sink *out;
+    LZ4F_cctx *context;
+    LZ4F_preferences_t preferences;
+    void *output;
+    size_t output_size;
+};
+
+#define LZ4_INPUT_STEP (64 * 1024)
+
+int lz4_sink_write(struct archive_sink *base, const void *data, size_t length) {
+    struct lz4_sink *sink = (struct lz4_sink *) base;
+    const char *bytes = data;
+    // Feed fixed steps so the output buffer sized at init always fits
+    while (length > 0) {
+        size_t step = length < LZ4_INPUT_STEP ? length : LZ4_INPUT_STEP;
+        size_t produced = LZ4F_compressUpdate(sink->context, sink->output, sink->output_size, bytes, step, NULL);
+        if (LZ4F_isError(produced) || (produced > 0 && sink->out->write(sink->out, sink->output, produced) != 0)) {
+            return -1;
+        }
+        bytes += step;
+        length -= step;
+    }
+    return 0;
+}
+
+int lz4_sink_init(struct lz4_sink *sink, struct archive_sink *out, int level) {
+    sink->base.write = lz4_sink_write;
+    sink->out = out;
+    memset(&sink->preferences, 0, sizeof(sink->preferences));
+    sink->preferences.compressionLevel = level;
+    sink->output_size = LZ4F_compressBound(LZ4_INPUT_STEP, &sink->preferences);
+    if (sink->output_size < LZ4F_HEADER_SIZE_MAX) {
+        sink->output_size = LZ4F_HEADER_SIZE_MAX;
+    }
+    sink->output = malloc(sink->output_size);
+    if (sink->output == NULL || LZ4F_isError(LZ4F_createCompressionContext(&sink->context, LZ4F_VERSION))) {
+        sink->context = NULL;
+        return -1;
+    }
+    size_t produced = LZ4F_compressBegin(sink->context, sink->output, sink->output_size, &sink->preferences);
+    if (LZ4F_isError(produced)) {
+        return -1;
+    }
+    return sink->out->write(sink->out, sink->output, produced);
+}
+
+int lz4_sink_finish(struct lz4_sink *sink) {
+    int status = -1;
+    if (sink->context != NULL) {
+        size_t produced = LZ4F_compressEnd(sink->context, sink->output, sink->output_size, NULL);
+        status = LZ4F_isError(produced) ? -1 : sink->out->write(sink->out, sink->output, produced);
+        LZ4F_freeCompressionContext(sink->context);
+    }
+    free(sink->output);
+    return status;
+}
+#endif
+
+// The archive pipeline writes tar into base; failed records an error inside the codec or below it,
+// which is what separates a broken stream from a file that could not be read
+struct codec_sink {
+    struct archive_sink base;
+    struct archive_sink *inner;
+    enum codec_id id;
+    int failed;
+    union {
+        struct gzip_sink gzip;
+#ifdef HAVE_ZSTD
+        struct zstd_sink zstd;
+#endif
+#ifdef HAVE_LZ4
+        struct lz4_sink lz4;
+#endif
+    };
+};
+
+int codec_sink_write(struct archive_sink *base, const void *data, size_t length) {
+    struct codec_sink *sink = (struct codec_sink *) base;
+    if (sink->failed || sink->inner->write(sink->inner, data, length) != 0) {
+        sink->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// link may be NULL when the output is not a connection; auto then compresses at gzip's default level
+int codec_sink_init(struct codec_sink *sink, struct codec_choice choice, struct archive_sink *out,
+                    const struct link_meter *link) {
+    int status = 0;
+    sink->base.write = codec_sink_write;
+    sink->id = choice.id;
+    sink->failed = 0;
+    switch (choice.id) {
+    case CODEC_AUTO:
+        sink->inner = &sink->gzip.base;
+        // A real level even when not adaptive: the level picks the rate and ratio slots
+        status = gzip_sink_init(&sink->gzip, out, codec_default_level(CODEC_GZIP));
+        sink->gzip.link = link;
+        sink->gzip.adaptive = link != NULL;
+        break;
+    case CODEC_GZIP:
+        sink->inner = &sink->gzip.base;
+        status = gzip_sink_init(&sink->gzip, out, choice.level);
+        break;
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        sink->inner = &sink->zstd.base;
+        status = zstd_sink_init(&sink->zstd, out, choice.level);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        sink->inner = &sink->lz4.base;
+        status = lz4_sink_init(&sink->lz4, out, choice.level);
+        break;
+#endif
+    default:
+        sink->id = CODEC_STORE;
+        sink->inner = out;
+        break;
+    }
+    if (status != 0) {
+        sink->failed = 1;
+    }
+    return status;
+}
+
+// Flush the codec's trailer and release it; always called once after a successful or failed init
+int codec_sink_finish(struct codec_sink *sink) {
+    int status = 0;
+    switch (sink->id) {
+    case CODEC_AUTO:
+    case CODEC_GZIP:
+        status = gzip_sink_finish(&sink->gzip);
+        break;
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        status = zstd_sink_finish(&sink->zstd);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        status = lz4_sink_finish(&sink->lz4);
+        break;
+#endif
+    default:
+        break;
+    }
+    if (status != 0) {
+        sink->failed = 1;
+    }
+    return sink->failed ? -1 : 0;
+}
+
+// ------------------------------------ archive streaming ------------------------------------
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+struct cache_flight;
+void cache_flight_progress(struct cache_flight *flight, size_t length);
+
+// Sends whatever is written as FRAME_ARCHIVE frames on a reply channel. With a copy the unframed
+// bytes also go to copy_fd, and a client that goes away does not stop the copy.
+struct chunk_sink {
+    struct archive_sink base;
+    struct reply_channel client;
+    int socket_failed;
+    struct link_meter meter;
+    int copy_fd;
+    int copy_failed;
+    struct cache_flight *flight; // told about every byte copied
+    size_t length;
+    unsigned char buffer[STREAM_CHUNK_SIZE];
+};
+
+// Returns -1 only when neither the socket nor the copy can take more
+int chunk_lost_socket(struct chunk_sink *sink) {
+    sink->socket_failed = 1;
+    return sink->copy_fd >= 0 && !sink->copy_failed ? 0 : -1;
+}
+
+int chunk_send(struct chunk_sink *sink, const void *data, size_t length) {
+    const char *bytes = data;
+    if (sink->socket_failed) {
+        return chunk_lost_socket(sink);
+    }
+    while (length > 0) {
+        size_t frame_length = length < FRAME_MAX_PAYLOAD ? length : FRAME_MAX_PAYLOAD;
+        if (send_frame(sink->client.socket, FRAME_ARCHIVE, 0, sink->client.request_id, bytes, frame_length) == -1) {
+            return chunk_lost_socket(sink);
+        }
+        link_meter_record(&sink->meter, FRAME_HEADER_SIZE + frame_length);
+        bytes += frame_length;
+        length -= frame_length;
+    }
+    return 0;
+}
+
+int chunk_sink_flush(struct chunk_sink *sink) {
+    if (sink->length == 0) {
+        return 0;
+    }
+    size_t length = sink->length;
+    sink->length = 0;
+    return chunk_send(sink, sink->buffer, length);
+}
+
+int chunk_sink_write(struct archive_sink *base, const void *data, size_t length) {
+    struct chunk_sink *sink = (struct chunk_sink *) base;
+    if (sink->copy_fd >= 0 && !sink->copy_failed) {
+        const char *bytes = data;
+        size_t remaining = length;
+        while (remaining > 0) {
+            ssize_t written = write(sink->copy_fd, bytes, remaining);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                sink->copy_failed = 1;
+                break;
+            }
+            bytes += written;
+            remaining -= written;
+        }
+        if (!sink->copy_failed && sink->flight != NULL) {
+            cache_flight_progress(sink->flight, length);
+        }
+        if (sink->copy_failed && sink->socket_failed) {
+            return -1;
+        }
+    }
+    // Large writes (whole compressed blocks) go out as their own chunk without copying
+    if (length >= STREAM_CHUNK_SIZE) {
+        if (chunk_sink_flush(sink) != 0) {
+            return -1;
+        }
+        return chunk_send(sink, data, length);
+    }
+    if (sink->length + length > STREAM_CHUNK_SIZE && chunk_sink_flush(sink) != 0) {
+        return -1;
+    }
+    memcpy(sink->buffer + sink->length, data, length);
+    sink->length += length;
+    return 0;
+}
+
+// Flush and close the archive; flags carries FRAME_FLAG_ERROR when it was cut short
+int chunk_sink_finish(struct chunk_sink *sink, int flags) {
+    if (flags == 0 && chunk_sink_flush(sink) != 0) {
+        return -1;
+    }
+    if (sink->socket_failed ||
+        send_frame(sink->client.socket, FRAME_ARCHIVE_END, flags, sink->client.request_id, NULL, 0) == -1) {
+        return chunk_lost_socket(sink);
+    }
+    return 0;
+}
+
+// walk -> tar -> codec -> socket. Nothing is sent until the first match, so a search that finds
+// nothing answers with the response frame alone.
+struct archive_stream {
+    struct reply_channel client;
+    int started;
+    int failed;
+    int added;
+    int copy_fd;
+    struct cache_flight *flight;
+    struct codec_choice codec;
+    struct chunk_sink chunks;
+    struct codec_sink encoder;
+};
+
+void archive_stream_init(struct archive_stream *stream, const struct reply_channel *client,
+                         const struct codec_choice *codec) {
+    stream->client = *client;
+    stream->codec = *codec;
+    stream->started = 0;
+    stream->failed = 0;
+    stream->added = 0;
+    stream->copy_fd = -1;
+    stream->flight = NULL;
+}
+
+int archive_stream_start(struct archive_stream *stream) {
+    stream->started = 1;
+    stream->chunks.base.write = chunk_sink_write;
+    stream->chunks.client = stream->client;
+    link_meter_init(&stream->chunks.meter, stream->client.socket);
+    stream->chunks.socket_failed = 0;
+    stream->chunks.copy_fd = stream->copy_fd;
+    stream->chunks.copy_failed = 0;
+    stream->chunks.flight = stream->flight;
+    stream->chunks.length = 0;
+    if (codec_sink_init(&stream->encoder, stream->codec, &stream->chunks.base, &stream->chunks.meter) != 0) {
+        stream->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Append one file; only a broken stream is an error, unreadable files are skipped
+int archive_stream_add(struct archive_stream *stream, const char *file_path) {
+    if (stream->failed || (!stream->started && archive_stream_start(stream) != 0)) {
+        return -1;
+    }
+    if (tar_write_file(&stream->encoder.base, file_path) == 0) {
+        stream->added++;
+    } else if (stream->encoder.failed) {
+        stream->failed = 1;
+        return -1;
+    } else {
+        fprintf(stderr, "Skipping '%s': %s\n", file_path, strerror(errno));
+    }
+    return 0;
+}
+
+// Close the archive, if anything matched; returns files sent or -1. An archive that broke off
+// is still closed, flagged, so the client is not left waiting for the rest.
+int archive_stream_finish(struct archive_stream *stream) {
+    if (!stream->started) {
+        return 0;
+    }
+    if (!stream->failed && tar_finish(&stream->encoder.base) != 0) {
+        stream->failed = 1;
+    }
+    if (codec_sink_finish(&stream->encoder) != 0) {
+        stream->failed = 1;
+    }
+    if (chunk_sink_finish(&stream->chunks, stream->failed ? FRAME_FLAG_ERROR : 0) != 0) {
+        stream->failed = 1;
+    }
+    return stream->failed || stream->chunks.socket_failed ? -1 : stream->added;
+}
+
+// Finish the stream and describe the outcome for the trailing response
+void archive_stream_respond(struct archive_stream *stream, char *response) {
+    int added = archive_stream_finish(stream);
+    if (added > 0) {
+        sprintf(response, "Tar archive sent: %d files", added);
+    } else if (added == 0) {
+        sprintf(response, "No file found");
+    } else {
+        sprintf(response, "Error sending TAR archive");
+    }
+}
+
+// ---------------------------------------- tree walker ----------------------------------------
+
+// The server's own directory under HOME (the archive cache), which no walk should see
+static dev_t excluded_dev;
+static ino_t excluded_ino;
+
+#define WALK_BUFFER_SIZE (32 * 1024)
+
+// A regular file found by the walker; the path lives in the finding thread's batch arena
+struct walk_entry {
+    size_t path;
+    unsigned short name; // offset of the base name within the path
+    ino_t ino;
+    long long size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+// A directory as it was just before the walker read it
+struct walk_dir {
+    size_t path;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+struct walk_batch {
+    char *arena;
+    size_t arena_length;
+    size_t arena_capacity;
+    struct walk_entry *entries;
+    size_t count;
+    size_t capacity;
+    struct walk_dir *dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+};
+
+// Directories waiting to be read. The owner pushes and pops the newest (depth first, so its
+// reads stay close together) and idle threads steal the oldest, which tend to be the largest
+// subtrees left.
+struct dir_stack {
+    pthread_mutex_t lock;
+    char **dirs;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct tree_walk {
+    void (*on_directory)(const char *directory); // called before each directory is read
+    int num_threads;
+    struct dir_stack *stacks;
+    struct walk_batch *batches;
+    size_t pending; // directories queued or being read
+    size_t queued;  // directories sitting in a stack
+    int idle;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct walk_thread_arg {
+    struct tree_walk *walk;
+    int index;
+};
+
+// Matches the kernel's record layout for getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int dir_stack_push(struct dir_stack *stack, char *directory) {
+    int status = 0;
+    pthread_mutex_lock(&stack->lock);
+    if (stack->head > 0 && stack->head == stack->tail) {
+        stack->head = stack->tail = 0;
+    }
+    if (stack->tail == stack->capacity) {
+        size_t capacity = stack->capacity > 0 ? stack->capacity * 2 : 64;
+        char **grown = realloc(stack->dirs, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            status = -1;
+        } else {
+            stack->dirs = grown;
+            stack->capacity = capacity;
+        }
+    }
+    if (status == 0) {
+        stack->dirs[stack->tail++] = directory;
+    }
+    pthread_mutex_unlock(&stack->lock);
+    return status;
+}
+
+char *dir_stack_pop(struct dir_stack *stack) {
+    char *directory = NULL;
+    pthread_mutex_lock(&stack->lock);
+    if (stack->head != stack->tail) {
+        directory = stack->dirs[--stack->tail];
+    }
+    pthread_mutex_unlock(&stack->lock);
+    return directory;
+}
+
+char *dir_stack_steal(struct dir_stack *stack) {
+    char *directory = NULL;
+    pthread_mutex_lock(&stack->lock);
+    if (stack->head != stack->tail) {
+        directory = stack->dirs[stack->head++];
+    }
+    pthread_mutex_unlock(&stack->lock);
+    return directory;
+}
+
+void walk_queue_directory(struct tree_walk *walk, int index, const char *directory) {
+    char *copy = strdup(directory);
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+    if (copy == NULL || dir_stack_push(&walk->stacks[index], copy) != 0) {
+        free(copy);
+        __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+        walk->failed = 1;
+        return;
+    }
+    __atomic_add_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&walk->lock);
+    if (walk->idle > 0) {
+        pthread_cond_signal(&walk->wake);
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Copy path into the batch arena; returns its offset or -1
+long walk_batch_path(struct walk_batch *batch, const char *path) {
+    size_t length = strlen(path) + 1;
+    if (batch->arena_length + length > batch->arena_capacity) {
+        size_t capacity = batch->arena_capacity > 0 ? batch->arena_capacity * 2 : 1 << 16;
+        while (capacity < batch->arena_length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(batch->arena, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        batch->arena = grown;
+        batch->arena_capacity = capacity;
+    }
+    memcpy(batch->arena + batch->arena_length, path, length);
+    batch->arena_length += length;
+    return batch->arena_length - length;
+}
+
+int walk_batch_add_dir(struct walk_batch *batch, const char *path, const struct stat *dir_stat) {
+    if (batch->dir_count == batch->dir_capacity) {
+        size_t capacity = batch->dir_capacity > 0 ? batch->dir_capacity * 2 : 64;
+        struct walk_dir *grown = realloc(batch->dirs, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        batch->dirs = grown;
+        batch->dir_capacity = capacity;
+    }
+    long offset = walk_batch_path(batch, path);
+    if (offset < 0) {
+        return -1;
+    }
+    struct walk_dir *dir = &batch->dirs[batch->dir_count++];
+    dir->path = offset;
+    dir->ino = dir_stat->st_ino;
+    dir->mtime = dir_stat->st_mtim;
+    return 0;
+}
+
+int walk_batch_add(struct walk_batch *batch, const char *path, size_t name_offset, const struct stat *file_stat) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? batch->capacity * 2 : 1024;
+        struct walk_entry *grown = realloc(batch->entries, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        batch->entries = grown;
+        batch->capacity = capacity;
+    }
+    long offset = walk_batch_path(batch, path);
+    if (offset < 0) {
+        return -1;
+    }
+    struct walk_entry *entry = &batch->entries[batch->count++];
+    entry->path = offset;
+    entry->name = name_offset;
+    entry->ino = file_stat->st_ino;
+    entry->size = file_stat->st_size;
+    entry->mtime = file_stat->st_mtim;
+    entry->ctime = file_stat->st_ctim;
+    return 0;
+}
+
+// Read one directory with getdents64. d_type spares a stat for subdirectories and everything
+// that is not a regular file; regular files get one fstatat relative to the open directory.
+void walk_directory(struct tree_walk *walk, int index, const char *directory) {
+    int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        fprintf(stderr, "Unable to open directory '%s': %s\n", directory, strerror(errno));
+        return;
+    }
+    // Taken before reading, so a later change to the entries always moves the mtime past this
+    struct stat dir_stat;
+    if (walk->on_directory != NULL) {
+        walk->on_directory(directory);
+    }
+    if (fstat(dir_fd, &dir_stat) != 0 || walk_batch_add_dir(&walk->batches[index], directory, &dir_stat) != 0) {
+        walk->failed = 1;
+    }
+
+    char buffer[WALK_BUFFER_SIZE] __attribute__((aligned(8)));
+    char path[PATH_MAX];
+    size_t prefix = snprintf(path, sizeof(path), "%s/", directory);
+    long length;
+    while (prefix < sizeof(path) && (length = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0) {
+        for (long offset = 0; offset < length;) {
+            const struct linux_dirent64 *entry = (const struct linux_dirent64 *) (buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if ((name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) ||
+                (entry->d_type != DT_REG && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+                continue;
+            }
+            if (prefix + strlen(name) >= sizeof(path)) {
+                continue;
+            }
+            strcpy(path + prefix, name);
+
+            struct stat file_stat;
+            int is_dir = entry->d_type == DT_DIR;
+            if (!is_dir || entry->d_ino == excluded_ino) {
+                if (fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                is_dir = S_ISDIR(file_stat.st_mode);
+                if (is_dir && file_stat.st_ino == excluded_ino && file_stat.st_dev == excluded_dev) {
+                    continue;
+                }
+            }
+            if (is_dir) {
+                walk_queue_directory(walk, index, path);
+            } else if (S_ISREG(file_stat.st_mode) && walk_batch_add(&walk->batches[index], path, prefix, &file_stat) != 0) {
+                walk->failed = 1;
+            }
+        }
+    }
+    close(dir_fd);
+}
+
+void *walk_thread_main(void *arg) {
+    struct walk_thread_arg *thread_arg = arg;
+    struct tree_walk *walk = thread_arg->walk;
+    int index = thread_arg->index;
+    for (;;) {
+        char *directory = dir_stack_pop(&walk->stacks[index]);
+        for (int i = 1; directory == NULL && i < walk->num_threads; i++) {
+            directory = dir_stack_steal(&walk->stacks[(index + i) % walk->num_threads]);
+        }
+        if (directory != NULL) {
+            __atomic_sub_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            walk_directory(walk, index, directory);
+            free(directory);
+            if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&walk->lock);
+                pthread_cond_broadcast(&walk->wake);
+                pthread_mutex_unlock(&walk->lock);
+            }
+            continue;
+        }
+
+        // Queuers bump queued before taking the lock, so checking it here cannot miss a wakeup
+        pthread_mutex_lock(&walk->lock);
+        if (__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&walk->lock);
+            return NULL;
+        }
+        if (__atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0) {
+            walk->idle++;
+            pthread_cond_wait(&walk->wake, &walk->lock);
+            walk->idle--;
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+// Collect every regular file under root without following symlinks (like find -type f), reading
+// directories on several threads at once; stat latency, not CPU, bounds a cold walk.
+int walk_tree(const char *root, void (*on_directory)(const char *directory), struct tree_walk *walk) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    memset(walk, 0, sizeof(*walk));
+    walk->on_directory = on_directory;
+    walk->num_threads = cores > 2 ? cores * 2 : 4;
+    walk->stacks = calloc(walk->num_threads, sizeof(*walk->stacks));
+    walk->batches = calloc(walk->num_threads, sizeof(*walk->batches));
+    pthread_t *threads = calloc(walk->num_threads, sizeof(*threads));
+    struct walk_thread_arg *args = calloc(walk->num_threads, sizeof(*args));
+    if (walk->stacks == NULL || walk->batches == NULL || threads == NULL || args == NULL) {
+        free(walk->stacks);
+        free(walk->batches);
+        free(threads);
+        free(args);
+        memset(walk, 0, sizeof(*walk));
+        walk->on_directory = on_directory;
+        walk->failed = 1;
+        return -1;
+    }
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->wake, NULL);
+    for (int i = 0; i < walk->num_threads; i++) {
+        pthread_mutex_init(&walk->stacks[i].lock, NULL);
+    }
+
+    walk_queue_directory(walk, 0, root);
+    int started = 0;
+    for (; started < walk->num_threads; started++) {
+        args[started].walk = walk;
+        args[started].index = started;
+        if (pthread_create(&threads[started], NULL, walk_thread_main, &args[started]) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        walk_thread_main(&args[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+    return walk->failed ? -1 : 0;
+}
+
+void tree_walk_free(struct tree_walk *walk) {
+    for (int i = 0; walk->stacks != NULL && i < walk->num_threads; i++) {
+        free(walk->stacks[i].dirs);
+        pthread_mutex_destroy(&walk->stacks[i].lock);
+    }
+    for (int i = 0; walk->batches != NULL && i < walk->num_threads; i++) {
+        free(walk->batches[i].arena);
+        free(walk->batches[i].entries);
+        free(walk->batches[i].dirs);
+    }
+    free(walk->stacks);
+    free(walk->batches);
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->wake);
+}
+
+static inline const char *walk_entry_path(const struct walk_batch *batch, const struct walk_entry *entry) {
+    return batch->arena + entry->path;
+}
+
+// ---------------------------------------- metadata index ----------------------------------------
+
+// Every regular file under HOME, built once at startup so queries never walk the tree and kept
+// current by the index watcher. Paths live in one arena; records refer to them by offset.
+enum record_state {
+    RECORD_LIVE,
+    RECORD_REMOVED,     // file is gone; the record stays until the index is compacted
+    RECORD_UNCONFIRMED  // under a subtree being rescanned and not seen again yet
+};
+
+struct file_record {
+    size_t path;          // offset of the full path in the arena
+    unsigned short name;  // offset of the base name within the path
+    unsigned short ext;   // offset of the extension within the path, 0 when there is none
+    unsigned char state;
+    unsigned int delta;   // position plus one of the record's entry in the size delta, 0 when in by_size
+    long long size;
+    time_t mtime;
+    time_t ctime;
+};
+
+struct size_entry {
+    long long size;
+    size_t record;
+};
+
+#define SECONDS_PER_DAY 86400
+
+// Records modified on one UTC day, sorted by mtime then record
+struct mtime_entry {
+    time_t mtime;
+    size_t record;
+};
+
+struct mtime_bucket {
+    long long day;
+    struct mtime_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+// Directories as last read: inode and the mtime taken just before reading, a zero mtime once an
+// event shows the entries changed since, a zero inode once the directory is gone. A start from a
+// snapshot rereads only directories whose inode or mtime no longer match.
+struct dir_record {
+    char *path;
+    ino_t ino;
+    struct timespec mtime;
+    int reread;
+};
+
+// Records whose name ends in .<extension> (the text after the last dot), in record order.
+// Extensions past the first 65534 share the last id, so scans for them check the name.
+#define EXTENSION_ID_SHARED UINT16_MAX
+
+struct extension_posting {
+    char *extension;
+    uint16_t id;          // value of the extension column for these records
+    size_t *records;
+    size_t count;
+    size_t capacity;
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    char *arena;
+    size_t arena_length;
+    size_t arena_capacity;
+    struct file_record *files;
+    size_t count;
+    size_t capacity;
+    size_t removed;
+    // Columns parallel to files, capacity rows each, for predicate scans
+    uint64_t *size_column;
+    int64_t *mtime_column;
+    uint16_t *extension_column; // extension id, 0 when the name has none
+    uint64_t *live_bits;        // bit i set while files[i] is live
+    size_t *slots;        // path lookup: record number plus one, zero for an empty slot
+    size_t slot_capacity; // a power of two, at least twice count
+    struct size_entry *by_size; // sorted by size, then record
+    size_t by_size_count;
+    struct size_entry *delta;   // sizes set since by_size was last merged, unsorted
+    size_t delta_count;
+    size_t delta_capacity;
+    struct mtime_bucket *buckets; // one per day with files, sorted by day
+    size_t bucket_count;
+    size_t bucket_capacity;
+    struct extension_posting *postings; // open-addressed by extension, a power of two
+    size_t posting_count;
+    size_t posting_capacity;
+    struct dir_record *dirs; // open-addressed by path, a power of two
+    size_t dir_count;
+    size_t dir_capacity;
+    uint64_t generation;
+    int restored; // loaded from a snapshot and unchanged since
+} file_index = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// Matched paths copied out of the index, so the archive is built without holding its lock
+struct path_list {
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t count;
+};
+
+int path_list_add(struct path_list *list, const char *path) {
+    size_t needed = strlen(path) + 1;
+    if (list->length + needed > list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 4096;
+        while (capacity < list->length + needed) {
+            capacity *= 2;
+        }
+        char *grown = realloc(list->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        list->data = grown;
+        list->capacity = capacity;
+    }
+    memcpy(list->data + list->length, path, needed);
+    list->length += needed;
+    list->count++;
+    return 0;
+}
+
+// Iterate with: for (const char *p = path_list_first(l); p != NULL; p = path_list_next(l, p))
+const char *path_list_first(const struct path_list *list) {
+    return list->length > 0 ? list->data : NULL;
+}
+
+const char *path_list_next(const struct path_list *list, const char *path) {
+    path += strlen(path) + 1;
+    return path < list->data + list->length ? path : NULL;
+}
+
+// True when path is one of the listed directories or lies under one
+int path_list_covers(const struct path_list *list, const char *path) {
+    for (const char *dir = path_list_first(list); dir != NULL; dir = path_list_next(list, dir)) {
+        size_t length = strlen(dir);
+        if (strncmp(path, dir, length) == 0 && (path[length] == '\0' || path[length] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void path_list_free(struct path_list *list) {
+    free(list->data);
+    memset(list, 0, sizeof(*list));
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+static inline const char *record_path(const struct file_record *record) {
+    return file_index.arena + record->path;
+}
+
+static inline const char *record_name(const struct file_record *record) {
+    return file_index.arena + record->path + record->name;
+}
+
+static inline void record_set_state(struct file_record *record, enum record_state state) {
+    size_t i = record - file_index.files;
+    record->state = state;
+    if (state == RECORD_LIVE) {
+        file_index.live_bits[i / 64] |= 1ULL << (i % 64);
+    } else {
+        file_index.live_bits[i / 64] &= ~(1ULL << (i % 64));
+    }
+}
+
+// Returns the slot holding path, or the empty slot where it belongs. Removed records keep their
+// slot, so a path that comes back revives its old record.
+static size_t index_find_slot(const size_t *slots, size_t capacity, const char *path) {
+    size_t mask = capacity - 1;
+    for (size_t slot = fnv1a(FNV_OFFSET, path, strlen(path)) & mask;; slot = (slot + 1) & mask) {
+        if (slots[slot] == 0 || strcmp(record_path(&file_index.files[slots[slot] - 1]), path) == 0) {
+            return slot;
+        }
+    }
+}
+
+static void index_fill_slots(size_t *slots, size_t capacity) {
+    for (size_t i = 0; i < file_index.count; i++) {
+        slots[index_find_slot(slots, capacity, record_path(&file_index.files[i]))] = i + 1;
+    }
+    free(file_index.slots);
+    file_index.slots = slots;
+    file_index.slot_capacity = capacity;
+}
+
+struct file_record *index_lookup(const char *path) {
+    if (file_index.slot_capacity == 0) {
+        return NULL;
+    }
+    size_t entry = file_index.slots[index_find_slot(file_index.slots, file_index.slot_capacity, path)];
+    return entry > 0 ? &file_index.files[entry - 1] : NULL;
+}
+
+// Grow the scan columns to capacity rows; the live bits of new rows start clear
+static int index_grow_columns(size_t capacity) {
+    uint64_t *sizes = realloc(file_index.size_column, capacity * sizeof(*sizes));
+    if (sizes == NULL) {
+        return -1;
+    }
+    file_index.size_column = sizes;
+    int64_t *mtimes = realloc(file_index.mtime_column, capacity * sizeof(*mtimes));
+    if (mtimes == NULL) {
+        return -1;
+    }
+    file_index.mtime_column = mtimes;
+    uint16_t *extensions = realloc(file_index.extension_column, capacity * sizeof(*extensions));
+    if (extensions == NULL) {
+        return -1;
+    }
+    file_index.extension_column = extensions;
+    uint64_t *live = realloc(file_index.live_bits, capacity / 64 * sizeof(*live));
+    if (live == NULL) {
+        return -1;
+    }
+    memset(live + file_index.capacity / 64, 0, (capacity - file_index.capacity) / 64 * sizeof(*live));
+    file_index.live_bits = live;
+    return 0;
+}
+
+// Append a record for a path that is not in the index yet. Returns 0 once it is appended, 1 when
+// the path is too long to index and nothing was appended, and -1 when out of memory.
+static int index_append(const char *path, size_t name_offset, long long size, time_t mtime, time_t ctime) {
+    size_t length = strlen(path) + 1;
+    if (name_offset > USHRT_MAX || length > USHRT_MAX) {
+        return 1;
+    }
+    if (file_index.arena_length + length > file_index.arena_capacity) {
+        size_t capacity = file_index.arena_capacity > 0 ? file_index.arena_capacity * 2 : 1 << 20;
+        char *grown = realloc(file_index.arena, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        file_index.arena = grown;
+        file_index.arena_capacity = capacity;
+    }
+    if (file_index.count == file_index.capacity) {
+        size_t capacity = file_index.capacity > 0 ? file_index.capacity * 2 : 4096;
+        struct file_record *grown = realloc(file_index.files, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        file_index.files = grown;
+        if (index_grow_columns(capacity) != 0) {
+            return -1;
+        }
+        file_index.capacity = capacity;
+    }
+    if ((file_index.count + 1) * 2 > file_index.slot_capacity) {
+        size_t capacity = file_index.slot_capacity > 0 ? file_index.slot_capacity * 2 : 8192;
+        size_t *slots = calloc(capacity, sizeof(*slots));
+        if (slots == NULL) {
+            return -1;
+        }
+        index_fill_slots(slots, capacity);
+    }
+
+    struct file_record *record = &file_index.files[file_index.count++];
+    const char *dot = strrchr(path + name_offset, '.');
+    record->path = file_index.arena_length;
+    record->name = name_offset;
+    record->ext = dot != NULL ? dot + 1 - path : 0;
+    record_set_state(record, RECORD_LIVE);
+    record->size = size;
+    record->mtime = mtime;
+    record->ctime = ctime;
+    file_index.size_column[file_index.count - 1] = size;
+    file_index.mtime_column[file_index.count - 1] = mtime;
+    file_index.extension_column[file_index.count - 1] = 0;
+    memcpy(file_index.arena + file_index.arena_length, path, length);
+    file_index.arena_length += length;
+    file_index.slots[index_find_slot(file_index.slots, file_index.slot_capacity, path)] = file_index.count;
+    return 0;
+}
+
+// Size order for range queries: a sorted array plus a small delta of records whose size was set
+// since the last merge. An entry counts only while its record points back at it (delta == 0 for
+// by_size, its position for the delta), so changing a size never has to find the old entry.
+int compare_size_entries(const void *a, const void *b) {
+    const struct size_entry *left = a;
+    const struct size_entry *right = b;
+    if (left->size != right->size) {
+        return left->size < right->size ? -1 : 1;
+    }
+    return left->record < right->record ? -1 : left->record > right->record;
+}
+
+// Sort every record that may still be live into by_size and empty the delta
+void size_index_rebuild(void) {
+    struct size_entry *sorted = malloc((file_index.count > 0 ? file_index.count : 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        perror("Error building size index");
+        return;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < file_index.count; i++) {
+        file_index.files[i].delta = 0;
+        if (file_index.files[i].state != RECORD_REMOVED) {
+            sorted[count].size = file_index.files[i].size;
+            sorted[count++].record = i;
+        }
+    }
+    qsort(sorted, count, sizeof(*sorted), compare_size_entries);
+    free(file_index.by_size);
+    file_index.by_size = sorted;
+    file_index.by_size_count = count;
+    file_index.delta_count = 0;
+}
+
+// Fold the delta into by_size: keep current entries from both, sort the delta, merge
+void size_index_merge(void) {
+    struct size_entry *merged = malloc((file_index.by_size_count + file_index.delta_count + 1) * sizeof(*merged));
+    if (merged == NULL) {
+        size_index_rebuild();
+        return;
+    }
+    size_t fresh = 0;
+    for (size_t i = 0; i < file_index.delta_count; i++) {
+        const struct file_record *record = &file_index.files[file_index.delta[i].record];
+        if (record->delta == i + 1 && record->state != RECORD_REMOVED) {
+            file_index.delta[fresh++] = file_index.delta[i];
+        }
+    }
+    qsort(file_index.delta, fresh, sizeof(*file_index.delta), compare_size_entries);
+
+    size_t count = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < file_index.by_size_count; i++) {
+        const struct size_entry *entry = &file_index.by_size[i];
+        const struct file_record *record = &file_index.files[entry->record];
+        if (record->delta != 0 || record->state == RECORD_REMOVED) {
+            continue;
+        }
+        while (next < fresh && compare_size_entries(&file_index.delta[next], entry) < 0) {
+            merged[count++] = file_index.delta[next++];
+        }
+        merged[count++] = *entry;
+    }
+    while (next < fresh) {
+        merged[count++] = file_index.delta[next++];
+    }
+    for (size_t i = 0; i < fresh; i++) {
+        file_index.files[file_index.delta[i].record].delta = 0;
+    }
+    free(file_index.by_size);
+    file_index.by_size = merged;
+    file_index.by_size_count = count;
+    file_index.delta_count = 0;
+}
+
+// Record a new size for a record; merges once the delta outgrows a small share of the index
+void size_index_push(size_t record) {
+    if (file_index.delta_count == file_index.delta_capacity) {
+        size_t capacity = file_index.delta_capacity > 0 ? file_index.delta_capacity * 2 : 1024;
+        struct size_entry *grown = realloc(file_index.delta, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            size_index_merge();
+            return;
+        }
+        file_index.delta = grown;
+        file_index.delta_capacity = capacity;
+    }
+    file_index.delta[file_index.delta_count].size = file_index.files[record].size;
+    file_index.delta[file_index.delta_count].record = record;
+    file_index.files[record].delta = ++file_index.delta_count;
+    if (file_index.delta_count >= 1024 && file_index.delta_count * 32 > file_index.by_size_count) {
+        size_index_merge();
+    }
+}
+
+// Modification order for date queries: every record, whatever its state, has exactly one entry
+// in the bucket for the day of its current mtime. A range query binary-searches only the two
+// edge buckets and takes the days between whole.
+static long long mtime_day(time_t mtime) {
+    return mtime >= 0 ? mtime / SECONDS_PER_DAY : -((-(long long) mtime + SECONDS_PER_DAY - 1) / SECONDS_PER_DAY);
+}
+
+int compare_mtime_entries(const void *a, const void *b) {
+    const struct mtime_entry *left = a;
+    const struct mtime_entry *right = b;
+    if (left->mtime != right->mtime) {
+        return left->mtime < right->mtime ? -1 : 1;
+    }
+    return left->record < right->record ? -1 : left->record > right->record;
+}
+
+// Index of the first bucket whose day is not before day
+static size_t mtime_bucket_search(long long day) {
+    size_t low = 0;
+    size_t high = file_index.bucket_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file_index.buckets[middle].day < day) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Index of the first entry in bucket not before (mtime, record)
+static size_t mtime_entry_search(const struct mtime_bucket *bucket, time_t mtime, size_t record) {
+    struct mtime_entry key = {mtime, record};
+    size_t low = 0;
+    size_t high = bucket->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_mtime_entries(&bucket->entries[middle], &key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static struct mtime_bucket *mtime_bucket_for(long long day) {
+    size_t position = mtime_bucket_search(day);
+    if (position < file_index.bucket_count && file_index.buckets[position].day == day) {
+        return &file_index.buckets[position];
+    }
+    if (file_index.bucket_count == file_index.bucket_capacity) {
+        size_t capacity = file_index.bucket_capacity > 0 ? file_index.bucket_capacity * 2 : 256;
+        struct mtime_bucket *grown = realloc(file_index.buckets, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        file_index.buckets = grown;
+        file_index.bucket_capacity = capacity;
+    }
+    memmove(&file_index.buckets[position + 1], &file_index.buckets[position],
+            (file_index.bucket_count - position) * sizeof(*file_index.buckets));
+    file_index.bucket_count++;
+    memset(&file_index.buckets[position], 0, sizeof(*file_index.buckets));
+    file_index.buckets[position].day = day;
+    return &file_index.buckets[position];
+}
+
+void mtime_index_insert(size_t record) {
+    time_t mtime = file_index.files[record].mtime;
+    struct mtime_bucket *bucket = mtime_bucket_for(mtime_day(mtime));
+    if (bucket == NULL) {
+        perror("Error updating mtime index");
+        return;
+    }
+    if (bucket->count == bucket->capacity) {
+        size_t capacity = bucket->capacity > 0 ? bucket->capacity * 2 : 16;
+        struct mtime_entry *grown = realloc(bucket->entries, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            perror("Error updating mtime index");
+            return;
+        }
+        bucket->entries = grown;
+        bucket->capacity = capacity;
+    }
+    size_t position = mtime_entry_search(bucket, mtime, record);
+    memmove(&bucket->entries[position + 1], &bucket->entries[position],
+            (bucket->count - position) * sizeof(*bucket->entries));
+    bucket->entries[position].mtime = mtime;
+    bucket->entries[position].record = record;
+    bucket->count++;
+}
+
+void mtime_index_remove(size_t record, time_t mtime) {
+    size_t bucket_position = mtime_bucket_search(mtime_day(mtime));
+    if (bucket_position == file_index.bucket_count || file_index.buckets[bucket_position].day != mtime_day(mtime)) {
+        return;
+    }
+    struct mtime_bucket *bucket = &file_index.buckets[bucket_position];
+    size_t position = mtime_entry_search(bucket, mtime, record);
+    if (position == bucket->count || bucket->entries[position].record != record) {
+        return;
+    }
+    memmove(&bucket->entries[position], &bucket->entries[position + 1],
+            (bucket->count - position - 1) * sizeof(*bucket->entries));
+    if (--bucket->count == 0) {
+        free(bucket->entries);
+        memmove(bucket, bucket + 1, (file_index.bucket_count - bucket_position - 1) * sizeof(*bucket));
+        file_index.bucket_count--;
+    }
+}
+
+// Sort every record by mtime once and cut the run into days
+void mtime_index_rebuild(void) {
+    for (size_t i = 0; i < file_index.bucket_count; i++) {
+        free(file_index.buckets[i].entries);
+    }
+    file_index.bucket_count = 0;
+    struct mtime_entry *sorted = malloc((file_index.count > 0 ? file_index.count : 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        perror("Error building mtime index");
+        return;
+    }
+    for (size_t i = 0; i < file_index.count; i++) {
+        sorted[i].mtime = file_index.files[i].mtime;
+        sorted[i].record = i;
+    }
+    qsort(sorted, file_index.count, sizeof(*sorted), compare_mtime_entries);
+    for (size_t start = 0, end; start < file_index.count; start = end) {
+        long long day = mtime_day(sorted[start].mtime);
+        for (end = start + 1; end < file_index.count && mtime_day(sorted[end].mtime) == day; end++) {
+        }
+        struct mtime_bucket *bucket = mtime_bucket_for(day);
+        if (bucket == NULL || (bucket->entries = malloc((end - start) * sizeof(*sorted))) == NULL) {
+            perror("Error building mtime index");
+            break;
+        }
+        memcpy(bucket->entries, &sorted[start], (end - start) * sizeof(*sorted));
+        bucket->count = bucket->capacity = end - start;
+    }
+    free(sorted);
+}
+
+// Extension postings: a path never changes its extension, so a record is only ever added to
+// one list. Removed records stay listed until the next rebuild and are skipped by queries.
+static struct extension_posting *extension_posting_find(const char *extension) {
+    if (file_index.posting_capacity == 0) {
+        return NULL;
+    }
+    size_t mask = file_index.posting_capacity - 1;
+    for (size_t slot = fnv1a(FNV_OFFSET, extension, strlen(extension)) & mask;; slot = (slot + 1) & mask) {
+        struct extension_posting *posting = &file_index.postings[slot];
+        if (posting->extension == NULL || strcmp(posting->extension, extension) == 0) {
+            return posting;
+        }
+    }
+}
+
+void extension_index_add(size_t record) {
+    file_index.extension_column[record] = 0;
+    if (file_index.files[record].ext == 0) {
+        return;
+    }
+    const char *extension = record_path(&file_index.files[record]) + file_index.files[record].ext;
+    if ((file_index.posting_count + 1) * 2 > file_index.posting_capacity) {
+        size_t capacity = file_index.posting_capacity > 0 ? file_index.posting_capacity * 2 : 256;
+        struct extension_posting *old = file_index.postings;
+        size_t old_capacity = file_index.posting_capacity;
+        file_index.postings = calloc(capacity, sizeof(*file_index.postings));
+        if (file_index.postings == NULL) {
+            file_index.postings = old;
+            perror("Error updating extension index");
+            return;
+        }
+        file_index.posting_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].extension != NULL) {
+                *extension_posting_find(old[i].extension) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct extension_posting *posting = extension_posting_find(extension);
+    if (posting->extension == NULL) {
+        if ((posting->extension = strdup(extension)) == NULL) {
+            perror("Error updating extension index");
+            return;
+        }
+        file_index.posting_count++;
+        posting->id = file_index.posting_count < EXTENSION_ID_SHARED ? file_index.posting_count : EXTENSION_ID_SHARED;
+    }
+    file_index.extension_column[record] = posting->id;
+    if (posting->count == posting->capacity) {
+        size_t capacity = posting->capacity > 0 ? posting->capacity * 2 : 8;
+        size_t *grown = realloc(posting->records, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            perror("Error updating extension index");
+            return;
+        }
+        posting->records = grown;
+        posting->capacity = capacity;
+    }
+    posting->records[posting->count++] = record;
+}
+
+void extension_index_rebuild(void) {
+    for (size_t i = 0; i < file_index.posting_capacity; i++) {
+        free(file_index.postings[i].extension);
+        free(file_index.postings[i].records);
+    }
+    free(file_index.postings);
+    file_index.postings = NULL;
+    file_index.posting_count = 0;
+    file_index.posting_capacity = 0;
+    for (size_t i = 0; i < file_index.count; i++) {
+        file_index.extension_column[i] = 0;
+        if (file_index.files[i].state != RECORD_REMOVED) {
+            extension_index_add(i);
+        }
+    }
+}
+
+struct dir_record *dir_table_find(const char *path) {
+    if (file_index.dir_capacity == 0) {
+        return NULL;
+    }
+    size_t mask = file_index.dir_capacity - 1;
+    for (size_t slot = fnv1a(FNV_OFFSET, path, strlen(path)) & mask;; slot = (slot + 1) & mask) {
+        struct dir_record *dir = &file_index.dirs[slot];
+        if (dir->path == NULL || strcmp(dir->path, path) == 0) {
+            return dir;
+        }
+    }
+}
+
+void dir_table_set(const char *path, ino_t ino, struct timespec mtime) {
+    if ((file_index.dir_count + 1) * 2 > file_index.dir_capacity) {
+        size_t capacity = file_index.dir_capacity > 0 ? file_index.dir_capacity * 2 : 1024;
+        struct dir_record *old = file_index.dirs;
+        size_t old_capacity = file_index.dir_capacity;
+        file_index.dirs = calloc(capacity, sizeof(*file_index.dirs));
+        if (file_index.dirs == NULL) {
+            file_index.dirs = old;
+            return;
+        }
+        file_index.dir_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].path != NULL) {
+                *dir_table_find(old[i].path) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct dir_record *dir = dir_table_find(path);
+    if (dir->path == NULL) {
+        if ((dir->path = strdup(path)) == NULL) {
+            return;
+        }
+        file_index.dir_count++;
+    }
+    dir->ino = ino;
+    dir->mtime = mtime;
+}
+
+void dir_table_mark_changed(const char *path) {
+    struct dir_record *dir = dir_table_find(path);
+    if (dir != NULL && dir->path != NULL) {
+        dir->mtime.tv_sec = 0;
+        dir->mtime.tv_nsec = 0;
+    }
+}
+
+void dir_table_remove_tree(const char *path) {
+    size_t length = strlen(path);
+    for (size_t i = 0; i < file_index.dir_capacity; i++) {
+        const char *dir_path = file_index.dirs[i].path;
+        if (dir_path != NULL && strncmp(dir_path, path, length) == 0 &&
+            (dir_path[length] == '\0' || dir_path[length] == '/')) {
+            file_index.dirs[i].ino = 0;
+        }
+    }
+}
+
+// Record the state of every directory a walk read
+void dir_table_load_walk(const struct tree_walk *walk) {
+    for (int i = 0; i < walk->num_threads; i++) {
+        const struct walk_batch *batch = &walk->batches[i];
+        for (size_t j = 0; j < batch->dir_count; j++) {
+            dir_table_set(batch->arena + batch->dirs[j].path, batch->dirs[j].ino, batch->dirs[j].mtime);
+        }
+    }
+}
+
+// Re-derive the size, mtime and extension orders after records were loaded or renumbered
+void index_rebuild_orders(void) {
+    size_index_rebuild();
+    mtime_index_rebuild();
+    extension_index_rebuild();
+}
+
+// Add or refresh a regular file; returns 1 when the index changed. Callers hold the write lock.
+int index_update_file(const char *path, long long size, time_t mtime, time_t ctime) {
+    struct file_record *record = index_lookup(path);
+    if (record == NULL) {
+        const char *slash = strrchr(path, '/');
+        if (index_append(path, slash != NULL ? slash + 1 - path : 0, size, mtime, ctime) != 0) {
+            // Skipped or out of memory: there is no new record to sort
+            return 0;
+        }
+        size_index_push(file_index.count - 1);
+        mtime_index_insert(file_index.count - 1);
+        extension_index_add(file_index.count - 1);
+        return 1;
+    }
+    int changed = record->state == RECORD_REMOVED || record->size != size || record->mtime != mtime ||
+                  record->ctime != ctime;
+    // A merge may have dropped a removed record's entry, so a revived one is always re-sorted
+    int resort = record->state == RECORD_REMOVED || record->size != size;
+    if (record->state == RECORD_REMOVED) {
+        file_index.removed--;
+    }
+    record_set_state(record, RECORD_LIVE);
+    record->size = size;
+    file_index.size_column[record - file_index.files] = size;
+    if (record->mtime != mtime) {
+        mtime_index_remove(record - file_index.files, record->mtime);
+        record->mtime = mtime;
+        file_index.mtime_column[record - file_index.files] = mtime;
+        mtime_index_insert(record - file_index.files);
+    }
+    record->ctime = ctime;
+    if (resort) {
+        size_index_push(record - file_index.files);
+    }
+    return changed;
+}
+
+int index_remove_file(const char *path) {
+    struct file_record *record = index_lookup(path);
+    if (record == NULL || record->state == RECORD_REMOVED) {
+        return 0;
+    }
+    record_set_state(record, RECORD_REMOVED);
+    file_index.removed++;
+    return 1;
+}
+
+static int index_under(const struct file_record *record, const char *directory, size_t length) {
+    const char *path = record_path(record);
+    return strncmp(path, directory, length) == 0 && path[length] == '/';
+}
+
+// Move every record in state from under directory to state to; returns how many moved
+size_t index_mark_tree(const char *directory, enum record_state from, enum record_state to) {
+    size_t length = strlen(directory);
+    size_t marked = 0;
+    for (size_t i = 0; i < file_index.count; i++) {
+        struct file_record *record = &file_index.files[i];
+        if (record->state == from && index_under(record, directory, length)) {
+            record_set_state(record, to);
+            marked++;
+        }
+    }
+    if (to == RECORD_REMOVED) {
+        file_index.removed += marked;
+    }
+    return marked;
+}
+
+// Drop removed records once they make up most of the index, keeping walk order
+void index_compact(void) {
+    if (file_index.removed < 1024 || file_index.removed * 2 < file_index.count) {
+        return;
+    }
+    size_t *slots = calloc(file_index.slot_capacity, sizeof(*slots));
+    if (slots == NULL) {
+        return;
+    }
+    size_t kept = 0;
+    size_t arena_length = 0;
+    for (size_t i = 0; i < file_index.count; i++) {
+        struct file_record record = file_index.files[i];
+        if (record.state != RECORD_LIVE) {
+            continue;
+        }
+        size_t length = strlen(record_path(&record)) + 1;
+        memmove(file_index.arena + arena_length, record_path(&record), length);
+        record.path = arena_length;
+        arena_length += length;
+        file_index.size_column[kept] = record.size;
+        file_index.mtime_column[kept] = record.mtime;
+        file_index.files[kept++] = record;
+    }
+    memset(file_index.live_bits, 0, file_index.capacity / 64 * sizeof(*file_index.live_bits));
+    for (size_t i = 0; i < kept; i++) {
+        file_index.live_bits[i / 64] |= 1ULL << (i % 64);
+    }
+    file_index.count = kept;
+    file_index.arena_length = arena_length;
+    file_index.removed = 0;
+    index_fill_slots(slots, file_index.slot_capacity);
+    index_rebuild_orders();
+}
+
+struct walk_ref {
+    const char *path;
+    const struct walk_entry *entry;
+};
+
+int compare_walk_refs(const void *a, const void *b) {
+    return strcmp(((const struct walk_ref *) a)->path, ((const struct walk_ref *) b)->path);
+}
+
+// Load a finished walk in path order, so results do not depend on which thread found what.
+// Returns the sum of per-file hashes of path, inode, size, mtime and ctime.
+uint64_t index_load_walk(const struct tree_walk *walk) {
+    size_t total = 0;
+    for (int i = 0; i < walk->num_threads; i++) {
+        total += walk->batches[i].count;
+    }
+    struct walk_ref *refs = malloc((total > 0 ? total : 1) * sizeof(*refs));
+    if (refs == NULL) {
+        perror("Error loading file index");
+        return FNV_OFFSET;
+    }
+    size_t count = 0;
+    for (int i = 0; i < walk->num_threads; i++) {
+        for (size_t j = 0; j < walk->batches[i].count; j++) {
+            refs[count].path = walk_entry_path(&walk->batches[i], &walk->batches[i].entries[j]);
+            refs[count++].entry = &walk->batches[i].entries[j];
+        }
+    }
+    qsort(refs, count, sizeof(*refs), compare_walk_refs);
+    dir_table_load_walk(walk);
+
+    uint64_t fingerprint = FNV_OFFSET;
+    for (size_t i = 0; i < count; i++) {
+        const struct walk_entry *entry = refs[i].entry;
+        if (index_append(refs[i].path, entry->name, entry->size, entry->mtime.tv_sec, entry->ctime.tv_sec) < 0) {
+            perror("Error loading file index");
+            break;
+        }
+        uint64_t hash = fnv1a(FNV_OFFSET, refs[i].path, strlen(refs[i].path) + 1);
+        hash = fnv1a(hash, &entry->ino, sizeof(entry->ino));
+        hash = fnv1a(hash, &entry->size, sizeof(entry->size));
+        hash = fnv1a(hash, &entry->mtime, sizeof(entry->mtime));
+        hash = fnv1a(hash, &entry->ctime, sizeof(entry->ctime));
+        fingerprint += hash;
+    }
+    free(refs);
+    return fingerprint;
+}
+
+void watch_directory(const char *directory);
+
+// The generation starts as a fingerprint of every indexed path, inode, size, mtime and ctime, so an
+// unchanged tree gets the same generation after a restart. The watcher then advances it by one for
+// each batch of changes it applies.
+void build_file_index(void) {
+    const char *home_dir = getenv("HOME");
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (home_dir != NULL) {
+        struct tree_walk walk;
+        if (walk_tree(home_dir, watch_directory, &walk) != 0) {
+            perror("Error building file index");
+        }
+        pthread_rwlock_wrlock(&file_index.lock);
+        file_index.generation = index_load_walk(&walk);
+        index_rebuild_orders();
+        pthread_rwlock_unlock(&file_index.lock);
+        tree_walk_free(&walk);
+    }
+    printf("Indexed %zu files in %.1f ms\n", file_index.count, elapsed_ms(&started));
+}
+
+// Called under the write lock once per batch of changes. The first change after a start from a
+// snapshot skips far ahead: a run that stopped without saving may already have handed out the
+// next generations, and the archive cache still holds what it built under them.
+void index_advance_generation(void) {
+    file_index.generation += file_index.restored ? 1ULL << 32 : 1;
+    file_index.restored = 0;
+}
+
+uint64_t index_generation(void) {
+    pthread_rwlock_rdlock(&file_index.lock);
+    uint64_t generation = file_index.generation;
+    pthread_rwlock_unlock(&file_index.lock);
+    return generation;
+}
+
+// Copy the paths of all matching records, in walk order
+typedef int (*record_filter)(const struct file_record *record, void *arg);
+
+int index_select(record_filter matches, void *arg, struct path_list *out) {
+    int status = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    for (size_t i = 0; i < file_index.count && status == 0; i++) {
+        if (file_index.files[i].state == RECORD_LIVE && matches(&file_index.files[i], arg)) {
+            status = path_list_add(out, record_path(&file_index.files[i]));
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    return status;
+}
+
+// Copy the paths of live files with min_size <= size <= max_size, in size order, and add up their
+// bytes; a binary search plus the matches, then a pass over the small delta
+int index_select_size(long long min_size, long long max_size, struct path_list *out, unsigned long long *total) {
+    int status = 0;
+    *total = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    size_t low = 0;
+    size_t high = file_index.by_size_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file_index.by_size[middle].size < min_size) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (size_t i = low; i < file_index.by_size_count && file_index.by_size[i].size <= max_size && status == 0; i++) {
+        const struct file_record *record = &file_index.files[file_index.by_size[i].record];
+        if (record->delta == 0 && record->state == RECORD_LIVE) {
+            status = path_list_add(out, record_path(record));
+            *total += record->size;
+        }
+    }
+    for (size_t i = 0; i < file_index.delta_count && status == 0; i++) {
+        const struct file_record *record = &file_index.files[file_index.delta[i].record];
+        if (record->delta == i + 1 && record->state == RECORD_LIVE && record->size >= min_size &&
+            record->size <= max_size) {
+            status = path_list_add(out, record_path(record));
+            *total += record->size;
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    return status;
+}
+
+// Copy the paths of live files with after < mtime <= until, oldest first
+int index_select_mtime(time_t after, time_t until, struct path_list *out) {
+    int status = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    long long last_day = mtime_day(until);
+    for (size_t i = mtime_bucket_search(mtime_day(after)); i < file_index.bucket_count && status == 0; i++) {
+        const struct mtime_bucket *bucket = &file_index.buckets[i];
+        if (bucket->day > last_day) {
+            break;
+        }
+        size_t first = bucket->entries[0].mtime > after ? 0 : mtime_entry_search(bucket, after, SIZE_MAX);
+        for (size_t j = first; j < bucket->count && bucket->entries[j].mtime <= until && status == 0; j++) {
+            const struct file_record *record = &file_index.files[bucket->entries[j].record];
+            if (record->state == RECORD_LIVE) {
+                status = path_list_add(out, record_path(record));
+            }
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    return status;
+}
+
+// Whether name ends in .<extension>, the way find -name '*.<extension>' matches it
+static int name_has_extension(const char *name, const char *extension, size_t extension_length) {
+    size_t name_length = strlen(name);
+    return name_length > extension_length && name[name_length - extension_length - 1] == '.' &&
+           strcmp(name + name_length - extension_length, extension) == 0;
+}
+
+int compare_record_numbers(const void *a, const void *b) {
+    size_t left = *(const size_t *) a;
+    size_t right = *(const size_t *) b;
+    return left < right ? -1 : left > right;
+}
+
+// Copy the paths of live files whose name ends in .<ext> for any of the extensions (like find
+// -name '*.<ext>' -o ...), in index order. Each extension reads the posting list of its last
+// dot-separated part; longer ones such as tar.gz then check the rest of the name.
+int index_select_extensions(char **extensions, int num_extensions, struct path_list *out) {
+    size_t *records = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int status = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    for (int i = 0; i < num_extensions && status == 0; i++) {
+        const char *dot = strrchr(extensions[i], '.');
+        const struct extension_posting *posting = extension_posting_find(dot != NULL ? dot + 1 : extensions[i]);
+        if (posting == NULL || posting->extension == NULL) {
+            continue;
+        }
+        size_t extension_length = strlen(extensions[i]);
+        for (size_t j = 0; j < posting->count; j++) {
+            const struct file_record *record = &file_index.files[posting->records[j]];
+            if (record->state != RECORD_LIVE) {
+                continue;
+            }
+            if (dot != NULL && !name_has_extension(record_name(record), extensions[i], extension_length)) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 1024;
+                size_t *grown = realloc(records, capacity * sizeof(*grown));
+                if (grown == NULL) {
+                    status = -1;
+                    break;
+                }
+                records = grown;
+            }
+            records[count++] = posting->records[j];
+        }
+    }
+    // Overlapping extensions (gz and tar.gz) list a file twice
+    qsort(records, count, sizeof(*records), compare_record_numbers);
+    for (size_t i = 0; i < count && status == 0; i++) {
+        if (i == 0 || records[i] != records[i - 1]) {
+            status = path_list_add(out, record_path(&file_index.files[records[i]]));
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    free(records);
+    return status;
+}
+
+// Column scans: predicates over the size, mtime and extension columns, evaluated 64 rows at a
+// time into selection bitmaps. Each predicate ANDs into the words still non-zero, so later ones
+// only look at rows the earlier ones kept. A range is one unsigned compare per row,
+// value - low <= span, which also covers signed mtimes.
+static uint64_t range_word_scalar(const uint64_t *column, size_t rows, uint64_t low, uint64_t span) {
+    uint64_t word = 0;
+    for (size_t i = 0; i < rows; i++) {
+        word |= (uint64_t) (column[i] - low <= span) << i;
+    }
+    return word;
+}
+
+static uint64_t extension_word_scalar(const uint16_t *column, size_t rows, const uint16_t *ids, int id_count) {
+    uint64_t word = 0;
+    for (size_t i = 0; i < rows; i++) {
+        for (int j = 0; j < id_count; j++) {
+            if (column[i] == ids[j]) {
+                word |= 1ULL << i;
+                break;
+            }
+        }
+    }
+    return word;
+}
+
+static uint64_t range_word_portable(const uint64_t *column, uint64_t low, uint64_t span) {
+    return range_word_scalar(column, 64, low, span);
+}
+
+static uint64_t extension_word_portable(const uint16_t *column, const uint16_t *ids, int id_count) {
+    return extension_word_scalar(column, 64, ids, id_count);
+}
+
+// First occurrence of a needle of two or more bytes in [from, end), or NULL
+static const char *find_literal_portable(const char *from, const char *end, const char *needle, size_t length) {
+    return memmem(from, end - from, needle, length);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// x86 has only signed 64-bit compares, so both sides get their sign bit flipped first
+__attribute__((target("sse4.2")))
+static uint64_t range_word_sse(const uint64_t *column, uint64_t low, uint64_t span) {
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    const __m128i lows = _mm_set1_epi64x(low);
+    const __m128i limit = _mm_set1_epi64x(span ^ (uint64_t) INT64_MIN);
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i += 2) {
+        __m128i values = _mm_loadu_si128((const __m128i *) (column + i));
+        __m128i offsets = _mm_xor_si128(_mm_sub_epi64(values, lows), sign);
+        int outside = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(offsets, limit)));
+        word |= (uint64_t) (~outside & 0x3) << i;
+    }
+    return word;
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t extension_word_sse(const uint16_t *column, const uint16_t *ids, int id_count) {
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i first = _mm_loadu_si128((const __m128i *) (column + i));
+        __m128i second = _mm_loadu_si128((const __m128i *) (column + i + 8));
+        __m128i first_hits = _mm_setzero_si128();
+        __m128i second_hits = _mm_setzero_si128();
+        for (int j = 0; j < id_count; j++) {
+            __m128i id = _mm_set1_epi16(ids[j]);
+            first_hits = _mm_or_si128(first_hits, _mm_cmpeq_epi16(first, id));
+            second_hits = _mm_or_si128(second_hits, _mm_cmpeq_epi16(second, id));
+        }
+        word |= (uint64_t) _mm_movemask_epi8(_mm_packs_epi16(first_hits, second_hits)) << i;
+    }
+    return word;
+}
+
+__attribute__((target("avx2")))
+static uint64_t range_word_avx2(const uint64_t *column, uint64_t low, uint64_t span) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lows = _mm256_set1_epi64x(low);
+    const __m256i limit = _mm256_set1_epi64x(span ^ (uint64_t) INT64_MIN);
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i += 4) {
+        __m256i values = _mm256_loadu_si256((const __m256i *) (column + i));
+        __m256i offsets = _mm256_xor_si256(_mm256_sub_epi64(values, lows), sign);
+        int outside = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(offsets, limit)));
+        word |= (uint64_t) (~outside & 0xF) << i;
+    }
+    return word;
+}
+
+// packs interleaves the two halves per 128-bit lane; the permute puts the rows back in order
+__attribute__((target("avx2")))
+static uint64_t extension_word_avx2(const uint16_t *column, const uint16_t *ids, int id_count) {
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i *) (column + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *) (column + i + 16));
+        __m256i first_hits = _mm256_setzero_si256();
+        __m256i second_hits = _mm256_setzero_si256();
+        for (int j = 0; j < id_count; j++) {
+            __m256i id = _mm256_set1_epi16(ids[j]);
+            first_hits = _mm256_or_si256(first_hits, _mm256_cmpeq_epi16(first, id));
+            second_hits = _mm256_or_si256(second_hits, _mm256_cmpeq_epi16(second, id));
+        }
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(first_hits, second_hits), 0xD8);
+        word |= (uint64_t) (uint32_t) _mm256_movemask_epi8(packed) << i;
+    }
+    return word;
+}
+
+// Candidates are the positions where both the first and the last byte of the needle line up, a
+// block at a time; only those are compared in full
+__attribute__((target("sse4.2")))
+static const char *find_literal_sse(const char *from, const char *end, const char *needle, size_t length) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    const char *block = from;
+    for (; end - block >= (ptrdiff_t) (length - 1 + 16); block += 16) {
+        __m128i starts = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) block), first);
+        __m128i ends = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (block + length - 1)), last);
+        for (unsigned int mask = _mm_movemask_epi8(_mm_and_si128(starts, ends)); mask != 0; mask &= mask - 1) {
+            const char *candidate = block + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, length - 2) == 0) {
+                return candidate;
+            }
+        }
+    }
+    return find_literal_portable(block, end, needle, length);
+}
+
+__attribute__((target("avx2")))
+static const char *find_literal_avx2(const char *from, const char *end, const char *needle, size_t length) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    const char *block = from;
+    for (; end - block >= (ptrdiff_t) (length - 1 + 32); block += 32) {
+        __m256i starts = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) block), first);
+        __m256i ends = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (block + length - 1)), last);
+        for (uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(starts, ends)); mask != 0; mask &= mask - 1) {
+            const char *candidate = block + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, length - 2) == 0) {
+                return candidate;
+            }
+        }
+    }
+    return find_literal_portable(block, end, needle, length);
+}
+#endif
+
+static struct {
+    const char *name;
+    uint64_t (*range_word)(const uint64_t *column, uint64_t low, uint64_t span);
+    uint64_t (*extension_word)(const uint16_t *column, const uint16_t *ids, int id_count);
+    const char *(*find_literal)(const char *from, const char *end, const char *needle, size_t length);
+} scan_kernels = {"scalar", range_word_portable, extension_word_portable, find_literal_portable};
+
+// Pick the widest kernels this CPU runs; called once before any query
+void select_scan_kernels(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_kernels.name = "avx2";
+        scan_kernels.range_word = range_word_avx2;
+        scan_kernels.extension_word = extension_word_avx2;
+        scan_kernels.find_literal = find_literal_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_kernels.name = "sse4.2";
+        scan_kernels.range_word = range_word_sse;
+        scan_kernels.extension_word = extension_word_sse;
+        scan_kernels.find_literal = find_literal_sse;
+    }
+#endif
+    printf("Predicate scans use %s kernels\n", scan_kernels.name);
+}
+
+// AND low <= value <= low + span (unsigned, wrapping) into the first count rows of bits
+static void column_select_range(const uint64_t *column, size_t count, uint64_t low, uint64_t span, uint64_t *bits) {
+    size_t full = count / 64;
+    for (size_t i = 0; i < full; i++) {
+        if (bits[i] != 0) {
+            bits[i] &= scan_kernels.range_word(column + i * 64, low, span);
+        }
+    }
+    if (count % 64 != 0 && bits[full] != 0) {
+        bits[full] &= range_word_scalar(column + full * 64, count % 64, low, span);
+    }
+}
+
+static void column_select_extensions(const uint16_t *column, size_t count, const uint16_t *ids, int id_count,
+                                     uint64_t *bits) {
+    size_t full = count / 64;
+    for (size_t i = 0; i < full; i++) {
+        if (bits[i] != 0) {
+            bits[i] &= scan_kernels.extension_word(column + i * 64, ids, id_count);
+        }
+    }
+    if (count % 64 != 0 && bits[full] != 0) {
+        bits[full] &= extension_word_scalar(column + full * 64, count % 64, ids, id_count);
+    }
+}
+
+// Predicates for index_select_filter; every one that is switched on must hold
+struct column_filter {
+    int by_size;           // min_size <= size <= max_size
+    long long min_size;
+    long long max_size;
+    int by_mtime;          // after < mtime <= until
+    time_t after;
+    time_t until;
+    char **extensions;     // name ends in .<ext> for any of them, when num_extensions > 0
+    int num_extensions;
+    const char *pattern;   // name matches this glob, when not NULL
+};
+
+// Copy the paths of live files passing every predicate, in index order, and add up their bytes.
+// Works on a copy of the live bits, so the scans touch only the columns they test; names are
+// read only for rows that pass every column.
+int index_select_filter(const struct column_filter *filter, struct path_list *out, unsigned long long *total) {
+    uint16_t ids[BUFFER_SIZE / 2];
+    int id_count = 0;
+    int check_names = 0;
+    int status = 0;
+    *total = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    size_t count = file_index.count;
+    size_t words = (count + 63) / 64;
+    uint64_t *bits = malloc((words > 0 ? words : 1) * sizeof(*bits));
+    if (bits == NULL) {
+        pthread_rwlock_unlock(&file_index.lock);
+        return -1;
+    }
+    memcpy(bits, file_index.live_bits, words * sizeof(*bits));
+
+    if (filter->by_size) {
+        if (filter->min_size > filter->max_size) {
+            memset(bits, 0, words * sizeof(*bits));
+        } else {
+            column_select_range(file_index.size_column, count, filter->min_size,
+                                (uint64_t) filter->max_size - (uint64_t) filter->min_size, bits);
+        }
+    }
+    if (filter->by_mtime) {
+        if (filter->after >= filter->until) {
+            memset(bits, 0, words * sizeof(*bits));
+        } else {
+            column_select_range((const uint64_t *) file_index.mtime_column, count, (uint64_t) filter->after + 1,
+                                (uint64_t) filter->until - (uint64_t) filter->after - 1, bits);
+        }
+    }
+    if (filter->num_extensions > 0) {
+        for (int i = 0; i < filter->num_extensions && id_count < (int) (sizeof(ids) / sizeof(*ids)); i++) {
+            const char *dot = strrchr(filter->extensions[i], '.');
+            const struct extension_posting *posting =
+                extension_posting_find(dot != NULL ? dot + 1 : filter->extensions[i]);
+            if (posting != NULL && posting->extension != NULL) {
+                ids[id_count++] = posting->id;
+                check_names |= dot != NULL || posting->id == EXTENSION_ID_SHARED;
+            }
+        }
+        if (id_count == 0) {
+            memset(bits, 0, words * sizeof(*bits));
+        } else {
+            column_select_extensions(file_index.extension_column, count, ids, id_count, bits);
+        }
+    }
+
+    for (size_t i = 0; i < words && status == 0; i++) {
+        for (uint64_t word = bits[i]; word != 0 && status == 0; word &= word - 1) {
+            const struct file_record *record = &file_index.files[i * 64 + __builtin_ctzll(word)];
+            if (check_names) {
+                int matched = 0;
+                for (int j = 0; j < filter->num_extensions && !matched; j++) {
+                    matched = name_has_extension(record_name(record), filter->extensions[j],
+                                                 strlen(filter->extensions[j]));
+                }
+                if (!matched) {
+                    continue;
+                }
+            }
+            if (filter->pattern != NULL && fnmatch(filter->pattern, record_name(record), 0) != 0) {
+                continue;
+            }
+            status = path_list_add(out, record_path(record));
+            *total += record->size;
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    free(bits);
+    return status;
+}
+
+// Name search for filesrch, by glob as find -name reads it or by POSIX extended regex, both
+// against the base name. Paths sit back to back in the arena in record order, so a literal that
+// every matching name has to contain is looked for across the arena in one sweep, and only the
+// records it lands in get the full test.
+struct name_search {
+    int regex;
+    const char *pattern;
+    regex_t compiled;
+    char literal[NAME_MAX + 1]; // empty when the pattern requires no fixed text
+    size_t literal_length;
+};
+
+// Keep the longest literal run seen; a cut-off run is still required text
+static void literal_run_end(char *run, size_t *run_length, struct name_search *search) {
+    if (*run_length > search->literal_length) {
+        memcpy(search->literal, run, *run_length);
+        search->literal_length = *run_length;
+        search->literal[*run_length] = '\0';
+    }
+    *run_length = 0;
+}
+
+static void literal_run_add(char *run, size_t *run_length, char c) {
+    if (*run_length < NAME_MAX) {
+        run[(*run_length)++] = c;
+    }
+}
+
+// Runs between wildcards and bracket expressions
+static void glob_literal(struct name_search *search) {
+    char run[NAME_MAX];
+    size_t run_length = 0;
+    for (const char *p = search->pattern; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?') {
+            literal_run_end(run, &run_length, search);
+        } else if (*p == '[') {
+            const char *q = p + 1;
+            q += *q == '!' || *q == '^';
+            q += *q == ']';
+            q = strchr(q, ']');
+            literal_run_end(run, &run_length, search);
+            if (q == NULL) {
+                break;
+            }
+            p = q;
+        } else if (*p == '\\' && p[1] != '\0') {
+            literal_run_add(run, &run_length, *++p);
+        } else {
+            literal_run_add(run, &run_length, *p);
+        }
+    }
+    literal_run_end(run, &run_length, search);
+}
+
+// Runs outside groups and brackets, less a last character that a quantifier may drop. With
+// alternation nothing is required, so there is no literal.
+static void regex_literal(struct name_search *search) {
+    if (strchr(search->pattern, '|') != NULL) {
+        return;
+    }
+    char run[NAME_MAX];
+    size_t run_length = 0;
+    int depth = 0;
+    for (const char *p = search->pattern; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?' || *p == '{') {
+            run_length -= run_length > 0;
+            literal_run_end(run, &run_length, search);
+            if (*p == '{' && (p = strchr(p, '}')) == NULL) {
+                break;
+            }
+        } else if (*p == '(' || *p == ')') {
+            depth += *p == '(' ? 1 : -1;
+            literal_run_end(run, &run_length, search);
+        } else if (*p == '[') {
+            const char *q = p + 1;
+            q += *q == '^';
+            q += *q == ']';
+            q = strchr(q, ']');
+            literal_run_end(run, &run_length, search);
+            if (q == NULL) {
+                break;
+            }
+            p = q;
+        } else if (*p == '\\' && ispunct((unsigned char) p[1]) && depth == 0) {
+            literal_run_add(run, &run_length, *++p);
+        } else if (*p == '\\' || *p == '.' || *p == '^' || *p == '$' || *p == '+' || depth > 0) {
+            // \w and the like are classes; + keeps the character before it but ends the run
+            literal_run_end(run, &run_length, search);
+            p += *p == '\\' && p[1] != '\0';
+        } else {
+            literal_run_add(run, &run_length, *p);
+        }
+    }
+    literal_run_end(run, &run_length, search);
+}
+
+// Returns -1 for a regex that does not compile
+int name_search_init(struct name_search *search, const char *pattern, int regex) {
+    memset(search, 0, sizeof(*search));
+    search->regex = regex;
+    search->pattern = pattern;
+    if (regex) {
+        if (regcomp(&search->compiled, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            return -1;
+        }
+        regex_literal(search);
+    } else {
+        glob_literal(search);
+    }
+    return 0;
+}
+
+void name_search_free(struct name_search *search) {
+    if (search->regex) {
+        regfree(&search->compiled);
+    }
+}
+
+static int name_search_matches(const struct name_search *search, const char *name) {
+    if (search->regex) {
+        return regexec(&search->compiled, name, 0, NULL, 0) == 0;
+    }
+    return fnmatch(search->pattern, name, 0) == 0;
+}
+
+static const char *find_literal(const char *from, const char *end, const char *needle, size_t length) {
+    if (length == 1) {
+        return memchr(from, needle[0], end - from);
+    }
+    return scan_kernels.find_literal(from, end, needle, length);
+}
+
+// The record whose path holds the arena byte at offset
+static size_t record_at_offset(size_t offset) {
+    size_t low = 0;
+    size_t high = file_index.count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (file_index.files[middle].path <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// The first live record from record on whose name matches, or count when there is none.
+// Callers hold the read lock.
+size_t name_search_next(const struct name_search *search, size_t record) {
+    if (search->literal_length == 0) {
+        for (; record < file_index.count; record++) {
+            const struct file_record *candidate = &file_index.files[record];
+            if (candidate->state == RECORD_LIVE && name_search_matches(search, record_name(candidate))) {
+                return record;
+            }
+        }
+        return file_index.count;
+    }
+    const char *end = file_index.arena + file_index.arena_length;
+    const char *from = record < file_index.count ? record_path(&file_index.files[record]) : end;
+    while (from < end) {
+        const char *hit = find_literal(from, end, search->literal, search->literal_length);
+        if (hit == NULL) {
+            break;
+        }
+        record = record_at_offset(hit - file_index.arena);
+        const struct file_record *candidate = &file_index.files[record];
+        if (hit < record_name(candidate)) {
+            // Only a directory above it has the text; the name may still have it too
+            from = record_name(candidate);
+            continue;
+        }
+        if (candidate->state == RECORD_LIVE && name_search_matches(search, record_name(candidate))) {
+            return record;
+        }
+        from = record_name(candidate) + strlen(record_name(candidate)) + 1;
+    }
+    return file_index.count;
+}
+
+// Stream every listed file; stops early only when the stream breaks
+void archive_paths(struct archive_stream *stream, const struct path_list *paths) {
+    for (const char *path = path_list_first(paths); path != NULL; path = path_list_next(paths, path)) {
+        if (archive_stream_add(stream, path) != 0) {
+            break;
+        }
+    }
+}
+
+// ---------------------------------------- index watcher ----------------------------------------
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_BUFFER_SIZE (64 * 1024)
+
+// One inotify watch per directory under HOME. The watcher thread applies each batch of events to
+// the index under one write lock, so steady-state cost is a stat per changed file. When the kernel
+// queue overflows, the whole tree is rescanned.
+static struct {
+    int fd;
+    const char *root;
+    pthread_mutex_t lock; // walker threads add watches concurrently
+    char **dirs;          // watched directory by watch descriptor
+    int capacity;
+    int exhausted;
+} index_watch = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+void watch_directory(const char *directory) {
+    if (index_watch.fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&index_watch.lock);
+    int wd = inotify_add_watch(index_watch.fd, directory, WATCH_EVENTS);
+    if (wd < 0) {
+        if (errno == ENOSPC && !index_watch.exhausted) {
+            fprintf(stderr, "Out of inotify watches; changes under '%s' and later directories go unseen\n", directory);
+            index_watch.exhausted = 1;
+        }
+        pthread_mutex_unlock(&index_watch.lock);
+        return;
+    }
+    if (wd >= index_watch.capacity) {
+        int capacity = index_watch.capacity > 0 ? index_watch.capacity : 1024;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        char **grown = realloc(index_watch.dirs, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            inotify_rm_watch(index_watch.fd, wd);
+            pthread_mutex_unlock(&index_watch.lock);
+            return;
+        }
+        memset(grown + index_watch.capacity, 0, (capacity - index_watch.capacity) * sizeof(*grown));
+        index_watch.dirs = grown;
+        index_watch.capacity = capacity;
+    }
+    // Watching a directory again under a new name reuses its descriptor
+    free(index_watch.dirs[wd]);
+    index_watch.dirs[wd] = strdup(directory);
+    pthread_mutex_unlock(&index_watch.lock);
+}
+
+void unwatch_tree(const char *directory) {
+    size_t length = strlen(directory);
+    for (int wd = 0; wd < index_watch.capacity; wd++) {
+        char *watched = index_watch.dirs[wd];
+        if (watched != NULL && strncmp(watched, directory, length) == 0 &&
+            (watched[length] == '\0' || watched[length] == '/')) {
+            inotify_rm_watch(index_watch.fd, wd);
+            free(watched);
+            index_watch.dirs[wd] = NULL;
+        }
+    }
+}
+
+// Bring one subtree back in line with the disk: watch it, re-stat every file and drop records for
+// files that are gone. The walk, which watches each directory before reading it, runs with no lock
+// held and only applying it takes the write lock. Changes made during the walk are queued on those
+// watches and applied after it, so they are never rolled back. A failed walk drops nothing, since
+// what it could not reach may still exist. Called with no lock held; returns the number of records
+// that changed.
+size_t rescan_tree(const char *directory) {
+    struct tree_walk walk;
+    int status = walk_tree(directory, watch_directory, &walk);
+
+    size_t changes = 0;
+    pthread_rwlock_wrlock(&file_index.lock);
+    if (status == 0) {
+        index_mark_tree(directory, RECORD_LIVE, RECORD_UNCONFIRMED);
+    }
+    for (int i = 0; i < walk.num_threads; i++) {
+        const struct walk_batch *batch = &walk.batches[i];
+        for (size_t j = 0; j < batch->count; j++) {
+            const struct walk_entry *entry = &batch->entries[j];
+            changes += index_update_file(walk_entry_path(batch, entry), entry->size, entry->mtime.tv_sec,
+                                         entry->ctime.tv_sec);
+        }
+    }
+    dir_table_load_walk(&walk);
+    if (status == 0) {
+        changes += index_mark_tree(directory, RECORD_UNCONFIRMED, RECORD_REMOVED);
+    }
+    if (changes > 0) {
+        index_advance_generation();
+        index_compact();
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    tree_walk_free(&walk);
+    return changes;
+}
+
+// New directories are added to rescans rather than walked here, under the lock
+size_t apply_watch_event(const struct inotify_event *event, struct path_list *rescans) {
+    if (event->wd < 0 || event->wd >= index_watch.capacity || index_watch.dirs[event->wd] == NULL) {
+        return 0;
+    }
+    if (event->mask & IN_IGNORED) {
+        free(index_watch.dirs[event->wd]);
+        index_watch.dirs[event->wd] = NULL;
+        return 0;
+    }
+    if (event->len == 0) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", index_watch.dirs[event->wd], event->name);
+    dir_table_mark_changed(index_watch.dirs[event->wd]);
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            unwatch_tree(path);
+            dir_table_remove_tree(path);
+            return index_mark_tree(path, RECORD_LIVE, RECORD_REMOVED);
+        }
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            path_list_add(rescans, path);
+        }
+        return 0;
+    }
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        return index_remove_file(path);
+    }
+
+    struct stat file_stat;
+    if (lstat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return index_remove_file(path);
+    }
+    return index_update_file(path, file_stat.st_size, file_stat.st_mtime, file_stat.st_ctime);
+}
+
+void *index_watch_main(void *arg) {
+    (void) arg;
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t length = read(index_watch.fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("Error reading index events");
+            return NULL;
+        }
+
+        int overflowed = 0;
+        size_t changes = 0;
+        struct path_list rescans = {0};
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (char *next = buffer; next < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *) next;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+            } else {
+                changes += apply_watch_event(event, &rescans);
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+        if (changes > 0) {
+            index_advance_generation();
+            index_compact();
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+
+        // Subtrees are walked with the lock released. Lost events say nothing about where they
+        // happened, so an overflow rescans the whole tree, which covers every queued rescan too.
+        if (overflowed) {
+            fprintf(stderr, "Index event queue overflowed; rescanning '%s'\n", index_watch.root);
+            rescan_tree(index_watch.root);
+        } else {
+            for (const char *path = path_list_first(&rescans); path != NULL; path = path_list_next(&rescans, path)) {
+                rescan_tree(path);
+            }
+        }
+        path_list_free(&rescans);
+    }
+}
+
+// Directories are watched as they are read, before their entries are, so changes made while
+// the index is built or loaded are queued rather than lost
+void watch_file_index(void) {
+    index_watch.root = getenv("HOME");
+    if (index_watch.root == NULL) {
+        return;
+    }
+    index_watch.fd = inotify_init1(IN_CLOEXEC);
+    if (index_watch.fd == -1) {
+        perror("Error creating index watch; the index will not follow changes");
+    }
+}
+
+void start_index_watcher(void) {
+    if (index_watch.fd == -1) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, index_watch_main, NULL) != 0) {
+        perror("Error starting index watcher");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+// ---------------------------------------- archive cache ----------------------------------------
+
+#define DEFAULT_CACHE_DIR ".archive_cache"
+#define DEFAULT_CACHE_MB 256
+#define CACHE_KEY_MAX 512
+
+// Finished archives, addressed by a hash of the normalized query and codec. Each entry is
+// <hash>.archive plus a <hash>.meta sidecar (key, generation, file count); the archive's mtime
+// records its last use so the LRU order survives a restart.
+struct cache_entry {
+    uint64_t hash;
+    char key[CACHE_KEY_MAX];
+    uint64_t generation;
+    unsigned long long size;
+    int files;
+    time_t last_used;
+    struct cache_entry *prev; // toward most recently used
+    struct cache_entry *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    const char *dir;
+    unsigned long long budget;
+    unsigned long long used;
+    struct cache_entry *head; // most recently used
+    struct cache_entry *tail;
+    struct cache_flight *flights;
+} archive_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .dir = DEFAULT_CACHE_DIR,
+    .budget = DEFAULT_CACHE_MB * 1024ULL * 1024ULL
+};
+
+// An archive being built into the cache. Identical requests that arrive meanwhile follow it,
+// streaming the temp file as it grows instead of building their own copy.
+struct cache_flight {
+    uint64_t hash;
+    char key[CACHE_KEY_MAX];
+    uint64_t generation;
+    char temp_path[PATH_MAX];
+    unsigned long long written;
+    int done;
+    int failed;
+    int files;
+    int refs;
+    pthread_cond_t progress;
+    struct cache_flight *next;
+};
+
+// The leader's side of a flight: the stream copies everything it sends into fd
+struct cache_fill {
+    struct cache_flight *flight;
+    int fd;
+};
+
+void cache_path(char *path, size_t size, uint64_t hash, const char *suffix) {
+    snprintf(path, size, "%s/%016llx.%s", archive_cache.dir, (unsigned long long) hash, suffix);
+}
+
+// Callers hold archive_cache.lock for the list helpers below
+void cache_unlink_entry(struct cache_entry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        archive_cache.head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        archive_cache.tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+void cache_push_front(struct cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = archive_cache.head;
+    if (archive_cache.head != NULL) {
+        archive_cache.head->prev = entry;
+    } else {
+        archive_cache.tail = entry;
+    }
+    archive_cache.head = entry;
+}
+
+void cache_drop(struct cache_entry *entry) {
+    char path[PATH_MAX];
+    cache_unlink_entry(entry);
+    archive_cache.used -= entry->size;
+    cache_path(path, sizeof(path), entry->hash, "archive");
+    unlink(path);
+    cache_path(path, sizeof(path), entry->hash, "meta");
+    unlink(path);
+    free(entry);
+}
+
+// Keep the list ordered by last use while loading
+void cache_insert_by_use(struct cache_entry *entry) {
+    struct cache_entry *after = NULL;
+    for (struct cache_entry *it = archive_cache.head; it != NULL && it->last_used >= entry->last_used; it = it->next) {
+        after = it;
+    }
+    if (after == NULL) {
+        cache_push_front(entry);
+        return;
+    }
+    entry->prev = after;
+    entry->next = after->next;
+    if (after->next != NULL) {
+        after->next->prev = entry;
+    } else {
+        archive_cache.tail = entry;
+    }
+    after->next = entry;
+}
+
+struct cache_entry *cache_find(uint64_t hash, const char *key) {
+    for (struct cache_entry *entry = archive_cache.head; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void cache_evict(void) {
+    while (archive_cache.used > archive_cache.budget && archive_cache.tail != NULL) {
+        cache_drop(archive_cache.tail);
+    }
+}
+
+#define FOLLOW_CHUNK_SIZE (1024 * 1024)
+
+// Send size bytes of an archive file from offset as FRAME_ARCHIVE frames, straight from the file
+int send_archive_range(const struct reply_channel *client, int fd, unsigned long long offset,
+                       unsigned long long size) {
+    while (size > 0) {
+        size_t length = size < FOLLOW_CHUNK_SIZE ? size : FOLLOW_CHUNK_SIZE;
+        if (send_frame_header(client->socket, FRAME_ARCHIVE, 0, client->request_id, length) == -1 ||
+            send_file_range(client->socket, fd, offset, length) == -1) {
+            return -1;
+        }
+        offset += length;
+        size -= length;
+    }
+    return 0;
+}
+
+// Sends a whole cached archive, then closes it
+int send_tar_file(int fd, unsigned long long size, const struct reply_channel *client) {
+    if (send_archive_range(client, fd, 0, size) == -1 ||
+        send_frame(client->socket, FRAME_ARCHIVE_END, 0, client->request_id, NULL, 0) == -1) {
+        perror("Error sending TAR file");
+        return -1;
+    }
+    return 0;
+}
+
+// Callers hold archive_cache.lock for the flight helpers
+struct cache_flight *cache_find_flight(uint64_t hash, const char *key, uint64_t generation) {
+    for (struct cache_flight *flight = archive_cache.flights; flight != NULL; flight = flight->next) {
+        if (flight->hash == hash && flight->generation == generation && strcmp(flight->key, key) == 0) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+struct cache_flight *cache_start_flight(uint64_t hash, const char *key, uint64_t generation, int *fd) {
+    struct cache_flight *flight = calloc(1, sizeof(*flight));
+    if (flight == NULL) {
+        return NULL;
+    }
+    flight->hash = hash;
+    strcpy(flight->key, key);
+    flight->generation = generation;
+    flight->refs = 1;
+    snprintf(flight->temp_path, sizeof(flight->temp_path), "%s/%016llx.%lx.tmp", archive_cache.dir,
+             (unsigned long long) hash, (unsigned long) pthread_self());
+    *fd = open(flight->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0) {
+        free(flight);
+        return NULL;
+    }
+    pthread_cond_init(&flight->progress, NULL);
+    flight->next = archive_cache.flights;
+    archive_cache.flights = flight;
+    return flight;
+}
+
+void cache_release_flight(struct cache_flight *flight) {
+    if (--flight->refs == 0) {
+        pthread_cond_destroy(&flight->progress);
+        free(flight);
+    }
+}
+
+// Called by the leader's stream after every byte it copies into the temp file
+void cache_flight_progress(struct cache_flight *flight, size_t length) {
+    pthread_mutex_lock(&archive_cache.lock);
+    flight->written += length;
+    pthread_cond_broadcast(&flight->progress);
+    pthread_mutex_unlock(&archive_cache.lock);
+}
+
+// Move a finished build into the cache; the caller holds archive_cache.lock
+int cache_store(struct cache_entry *entry, const char *temp_path) {
+    char path[PATH_MAX];
+    struct cache_entry *old = cache_find(entry->hash, entry->key);
+    if (old != NULL) {
+        cache_drop(old);
+    }
+    cache_path(path, sizeof(path), entry->hash, "archive");
+    if (rename(temp_path, path) != 0) {
+        return -1;
+    }
+    cache_path(path, sizeof(path), entry->hash, "meta");
+    FILE *meta = fopen(path, "w");
+    int stored = meta != NULL && fprintf(meta, "%s\n%llu\n%d\n", entry->key, (unsigned long long) entry->generation,
+                                         entry->files) > 0;
+    if (meta != NULL && fclose(meta) != 0) {
+        stored = 0;
+    }
+    if (!stored) {
+        unlink(path);
+        cache_path(path, sizeof(path), entry->hash, "archive");
+        unlink(path);
+        return -1;
+    }
+    cache_push_front(entry);
+    archive_cache.used += entry->size;
+    cache_evict();
+    return 0;
+}
+
+// Stream another request's build to this client as the leader appends to its temp file
+void follow_flight(struct cache_flight *flight, int fd, const struct reply_channel *client, char *response) {
+    unsigned long long offset = 0;
+    while (1) {
+        pthread_mutex_lock(&archive_cache.lock);
+        while (flight->written == offset && !flight->done) {
+            pthread_cond_wait(&flight->progress, &archive_cache.lock);
+        }
+        unsigned long long available = flight->written - offset;
+        int failed = flight->failed;
+        int files = flight->files;
+        pthread_mutex_unlock(&archive_cache.lock);
+
+        if (offset == 0 && available == 0 && !failed) {
+            // The build finished without writing anything: nothing matched
+            sprintf(response, "No file found");
+            return;
+        }
+        if (available > 0) {
+            if (send_archive_range(client, fd, offset, available) == -1) {
+                break;
+            }
+            offset += available;
+            continue;
+        }
+
+        if (failed) {
+            send_frame(client->socket, FRAME_ARCHIVE_END, FRAME_FLAG_ERROR, client->request_id, NULL, 0);
+            break;
+        }
+        if (send_frame(client->socket, FRAME_ARCHIVE_END, 0, client->request_id, NULL, 0) == -1) {
+            break;
+        }
+        sprintf(response, "Tar archive sent: %d files (shared build)", files);
+        return;
+    }
+    sprintf(response, "Error sending TAR archive");
+}
+
+// Serve query from the cache, follow an identical build already in progress, or become the
+// build that fills the cache. Returns 1 when the request has been answered.
+int archive_cache_begin(struct cache_fill *fill, const char *query, struct archive_stream *stream,
+                        char *response) {
+    fill->flight = NULL;
+    fill->fd = -1;
+    if (archive_cache.dir == NULL) {
+        return 0;
+    }
+    char key[CACHE_KEY_MAX];
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), " codec=%d:%d", stream->codec.id, stream->codec.level);
+    uint64_t hash = fnv1a(fnv1a(FNV_OFFSET, query, strlen(query)), suffix, strlen(suffix));
+    if (strlen(query) + strlen(suffix) < sizeof(key)) {
+        snprintf(key, sizeof(key), "%s%s", query, suffix);
+    } else {
+        // Too long to keep whole: a prefix plus the full hash still tells long queries apart. The
+        // entry is then hashed by this stored form, which is what load_archive_cache checks.
+        snprintf(key, sizeof(key), "%.*s... #%016llx%s", (int) (sizeof(key) - 64), query, (unsigned long long) hash,
+                 suffix);
+        hash = fnv1a(FNV_OFFSET, key, strlen(key));
+    }
+    uint64_t generation = index_generation();
+
+    pthread_mutex_lock(&archive_cache.lock);
+    struct cache_entry *entry = cache_find(hash, key);
+    struct cache_flight *flight = NULL;
+    int fd = -1;
+    int files = 0;
+    unsigned long long size = 0;
+    if (entry != NULL && entry->generation != generation) {
+        cache_drop(entry);
+    } else if (entry != NULL) {
+        char path[PATH_MAX];
+        cache_path(path, sizeof(path), entry->hash, "archive");
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            cache_unlink_entry(entry);
+            cache_push_front(entry);
+            futimens(fd, NULL);
+            entry->last_used = time(NULL);
+            files = entry->files;
+            size = entry->size;
+        } else {
+            cache_drop(entry);
+        }
+    }
+    if (fd < 0 && (flight = cache_find_flight(hash, key, generation)) != NULL) {
+        // Opened under the lock so the leader cannot rename or unlink it first
+        fd = open(flight->temp_path, O_RDONLY);
+        if (fd >= 0) {
+            flight->refs++;
+        } else {
+            flight = NULL;
+        }
+    } else if (fd < 0) {
+        fill->flight = cache_start_flight(hash, key, generation, &fill->fd);
+    }
+    pthread_mutex_unlock(&archive_cache.lock);
+
+    // Eviction only unlinks, so the open descriptor stays valid while it is sent
+    if (flight != NULL) {
+        follow_flight(flight, fd, &stream->client, response);
+        close(fd);
+        pthread_mutex_lock(&archive_cache.lock);
+        cache_release_flight(flight);
+        pthread_mutex_unlock(&archive_cache.lock);
+        return 1;
+    }
+    if (fd >= 0) {
+        send_tar_file(fd, size, &stream->client);
+        close(fd);
+        sprintf(response, "Tar archive sent: %d files (cached)", files);
+        return 1;
+    }
+    if (fill->flight != NULL) {
+        stream->copy_fd = fill->fd;
+        stream->flight = fill->flight;
+    }
+    return 0;
+}
+
+// Finish the stream, wake its followers, and keep the archive if it is complete
+void archive_cache_finish(struct cache_fill *fill, struct archive_stream *stream, char *response) {
+    archive_stream_respond(stream, response);
+    struct cache_flight *flight = fill->flight;
+    if (flight == NULL) {
+        return;
+    }
+    int intact = !stream->failed && !stream->chunks.copy_failed;
+    if (close(fill->fd) != 0) {
+        intact = 0;
+    }
+
+    struct cache_entry *entry = NULL;
+    if (intact && stream->added > 0) {
+        entry = calloc(1, sizeof(*entry));
+    }
+    if (entry != NULL) {
+        entry->hash = flight->hash;
+        strcpy(entry->key, flight->key);
+        entry->generation = flight->generation;
+        entry->size = flight->written;
+        entry->files = stream->added;
+        entry->last_used = time(NULL);
+    }
+
+    pthread_mutex_lock(&archive_cache.lock);
+    struct cache_flight **link = &archive_cache.flights;
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    flight->done = 1;
+    flight->failed = !intact;
+    flight->files = stream->added;
+    pthread_cond_broadcast(&flight->progress);
+
+    if (entry != NULL && cache_store(entry, flight->temp_path) != 0) {
+        free(entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        unlink(flight->temp_path);
+    }
+    cache_release_flight(flight);
+    pthread_mutex_unlock(&archive_cache.lock);
+}
+
+// Reload entries left by a previous run, placed in the list by their last use
+// The directory also holds in-progress builds, so it is needed even with a zero budget
+void load_archive_cache(void) {
+    if (mkdir(archive_cache.dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating cache directory");
+        archive_cache.dir = NULL;
+        return;
+    }
+    DIR *dir = opendir(archive_cache.dir);
+    struct stat dir_stat;
+    if (dir == NULL || fstat(dirfd(dir), &dir_stat) != 0) {
+        perror("Error opening cache directory");
+        archive_cache.dir = NULL;
+        return;
+    }
+    excluded_dev = dir_stat.st_dev;
+    excluded_ino = dir_stat.st_ino;
+
+    int count = 0;
+    struct dirent *ent;
+    pthread_mutex_lock(&archive_cache.lock);
+    while ((ent = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        size_t length = strlen(ent->d_name);
+        snprintf(path, sizeof(path), "%s/%s", archive_cache.dir, ent->d_name);
+        if (length > 4 && strcmp(ent->d_name + length - 4, ".tmp") == 0) {
+            unlink(path); // a build that never finished
+            continue;
+        }
+        unsigned long long hash;
+        char suffix[8];
+        if (sscanf(ent->d_name, "%16llx.%7s", &hash, suffix) != 2 || strcmp(suffix, "meta") != 0) {
+            continue;
+        }
+
+        struct cache_entry *entry = calloc(1, sizeof(*entry));
+        FILE *meta = fopen(path, "r");
+        int valid = entry != NULL && meta != NULL && fgets(entry->key, sizeof(entry->key), meta) != NULL;
+        if (valid) {
+            unsigned long long generation;
+            entry->key[strcspn(entry->key, "\n")] = '\0';
+            entry->hash = hash;
+            valid = fscanf(meta, "%llu %d", &generation, &entry->files) == 2 &&
+                    fnv1a(FNV_OFFSET, entry->key, strlen(entry->key)) == hash;
+            entry->generation = generation;
+        }
+        if (meta != NULL) {
+            fclose(meta);
+        }
+
+        char archive_path[PATH_MAX];
+        struct stat archive_stat;
+        cache_path(archive_path, sizeof(archive_path), hash, "archive");
+        if (valid && stat(archive_path, &archive_stat) == 0) {
+            entry->size = archive_stat.st_size;
+            entry->last_used = archive_stat.st_mtime;
+            cache_insert_by_use(entry);
+            archive_cache.used += entry->size;
+            count++;
+        } else {
+            free(entry);
+            unlink(path);
+            unlink(archive_path);
+        }
+    }
+    closedir(dir);
+    cache_evict();
+    pthread_mutex_unlock(&archive_cache.lock);
+    printf("Archive cache: %d entries, %llu bytes\n", count, archive_cache.used);
+}
+
+// ---------------------------------------- index snapshot ----------------------------------------
+
+#define SNAPSHOT_NAME "file_index.snapshot"
+#define SNAPSHOT_MAGIC "FIDXSNP1"
+#define SNAPSHOT_INTERVAL 300 // seconds between snapshots while the index keeps changing
+
+// The index saved beside the archive cache, so a restart maps it instead of walking HOME. It is
+// pointer-free: each column is an array at an 8-byte aligned offset from the start of the file
+// and paths are offsets into one NUL-separated arena, so it is read straight from the mapping.
+struct snapshot_header {
+    char magic[8];
+    uint64_t length; // of the whole file
+    uint64_t generation;
+    uint64_t file_count;
+    uint64_t dir_count;
+    uint64_t arena_length;
+    uint64_t root;       // arena offset of the HOME the snapshot was taken of
+    uint64_t file_path;  // uint64 arena offset per file
+    uint64_t file_name;  // uint16 offset of the base name within the path per file
+    uint64_t file_size;  // int64 per file
+    uint64_t file_mtime; // int64 per file
+    uint64_t file_ctime; // int64 per file
+    uint64_t dir_path;   // uint64 arena offset per directory
+    uint64_t dir_ino;    // uint64 per directory
+    uint64_t dir_mtime;  // int64 seconds and nanoseconds per directory
+    uint64_t arena;
+};
+
+static struct {
+    sigset_t signals; // shutdown signals, taken by the snapshot thread
+    uint64_t written; // generation of the snapshot on disk
+    int current;      // whether the snapshot on disk matches written
+} index_snapshot;
+
+static uint64_t snapshot_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t) 7;
+}
+
+int snapshot_path(char *path, size_t size, const char *suffix) {
+    if (archive_cache.dir == NULL || index_watch.root == NULL) {
+        return -1;
+    }
+    snprintf(path, size, "%s/%s%s", archive_cache.dir, SNAPSHOT_NAME, suffix);
+    return 0;
+}
+
+static void snapshot_put(FILE *out, uint64_t *offset, uint64_t at, const void *data, size_t length) {
+    static const char padding[8];
+    if (at > *offset) {
+        fwrite(padding, 1, at - *offset, out);
+    }
+    fwrite(data, 1, length, out);
+    *offset = at + length;
+}
+
+// Write the live index to a temp file and rename it into place. The image is laid out in memory
+// under the read lock, so the watcher waits only for that copy and not for the disk.
+int write_index_snapshot(void) {
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    if (snapshot_path(path, sizeof(path), "") != 0 || snapshot_path(temp_path, sizeof(temp_path), ".tmp") != 0) {
+        return -1;
+    }
+    char *image = NULL;
+    size_t image_length = 0;
+    FILE *out = open_memstream(&image, &image_length);
+    if (out == NULL) {
+        perror("Error writing index snapshot");
+        return -1;
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.generation = file_index.generation;
+    for (size_t i = 0; i < file_index.count; i++) {
+        if (file_index.files[i].state == RECORD_LIVE) {
+            header.file_count++;
+            header.arena_length += strlen(record_path(&file_index.files[i])) + 1;
+        }
+    }
+    for (size_t i = 0; i < file_index.dir_capacity; i++) {
+        if (file_index.dirs[i].path != NULL && file_index.dirs[i].ino != 0) {
+            header.dir_count++;
+            header.arena_length += strlen(file_index.dirs[i].path) + 1;
+        }
+    }
+    header.root = header.arena_length;
+    header.arena_length += strlen(index_watch.root) + 1;
+    header.file_path = snapshot_align(sizeof(header));
+    header.file_name = header.file_path + header.file_count * sizeof(uint64_t);
+    header.file_size = snapshot_align(header.file_name + header.file_count * sizeof(uint16_t));
+    header.file_mtime = header.file_size + header.file_count * sizeof(int64_t);
+    header.file_ctime = header.file_mtime + header.file_count * sizeof(int64_t);
+    header.dir_path = header.file_ctime + header.file_count * sizeof(int64_t);
+    header.dir_ino = header.dir_path + header.dir_count * sizeof(uint64_t);
+    header.dir_mtime = header.dir_ino + header.dir_count * sizeof(uint64_t);
+    header.arena = header.dir_mtime + header.dir_count * 2 * sizeof(int64_t);
+    header.length = header.arena + header.arena_length;
+
+    uint64_t offset = 0;
+    snapshot_put(out, &offset, 0, &header, sizeof(header));
+    uint64_t arena_offset = 0;
+    for (size_t i = 0; i < file_index.count; i++) {
+        if (file_index.files[i].state == RECORD_LIVE) {
+            snapshot_put(out, &offset, offset > header.file_path ? offset : header.file_path, &arena_offset, sizeof(arena_offset));
+            arena_offset += strlen(record_path(&file_index.files[i])) + 1;
+        }
+    }
+    for (size_t i = 0; i < file_index.count; i++) {
+        if (file_index.files[i].state == RECORD_LIVE) {
+            uint16_t name = file_index.files[i].name;
+            snapshot_put(out, &offset, offset > header.file_name ? offset : header.file_name, &name, sizeof(name));
+        }
+    }
+    for (int column = 0; column < 3; column++) {
+        uint64_t at = column == 0 ? header.file_size : column == 1 ? header.file_mtime : header.file_ctime;
+        for (size_t i = 0; i < file_index.count; i++) {
+            const struct file_record *record = &file_index.files[i];
+            if (record->state == RECORD_LIVE) {
+                int64_t value = column == 0 ? record->size : column == 1 ? record->mtime : record->ctime;
+                snapshot_put(out, &offset, offset > at ? offset : at, &value, sizeof(value));
+            }
+        }
+    }
+    for (int column = 0; column < 3; column++) {
+        uint64_t at = column == 0 ? header.dir_path : column == 1 ? header.dir_ino : header.dir_mtime;
+        for (size_t i = 0; i < file_index.dir_capacity; i++) {
+            const struct dir_record *dir = &file_index.dirs[i];
+            if (dir->path == NULL || dir->ino == 0) {
+                continue;
+            }
+            if (column == 0) {
+                snapshot_put(out, &offset, offset > at ? offset : at, &arena_offset, sizeof(arena_offset));
+                arena_offset += strlen(dir->path) + 1;
+            } else if (column == 1) {
+                uint64_t ino = dir->ino;
+                snapshot_put(out, &offset, offset > at ? offset : at, &ino, sizeof(ino));
+            } else {
+                int64_t mtime[2] = {dir->mtime.tv_sec, dir->mtime.tv_nsec};
+                snapshot_put(out, &offset, offset > at ? offset : at, mtime, sizeof(mtime));
+            }
+        }
+    }
+    for (size_t i = 0; i < file_index.count; i++) {
+        if (file_index.files[i].state == RECORD_LIVE) {
+            const char *file_path = record_path(&file_index.files[i]);
+            snapshot_put(out, &offset, offset > header.arena ? offset : header.arena, file_path, strlen(file_path) + 1);
+        }
+    }
+    for (size_t i = 0; i < file_index.dir_capacity; i++) {
+        if (file_index.dirs[i].path != NULL && file_index.dirs[i].ino != 0) {
+            snapshot_put(out, &offset, offset, file_index.dirs[i].path, strlen(file_index.dirs[i].path) + 1);
+        }
+    }
+    snapshot_put(out, &offset, offset > header.arena ? offset : header.arena, index_watch.root,
+                 strlen(index_watch.root) + 1);
+    int failed = ferror(out);
+    pthread_rwlock_unlock(&file_index.lock);
+
+    if (fclose(out) != 0 || failed || offset != header.length || image_length != header.length) {
+        perror("Error writing index snapshot");
+        free(image);
+        return -1;
+    }
+    out = fopen(temp_path, "w");
+    if (out == NULL) {
+        perror("Error writing index snapshot");
+        free(image);
+        return -1;
+    }
+    failed = fwrite(image, 1, image_length, out) != image_length || fflush(out) != 0 || fsync(fileno(out)) != 0;
+    free(image);
+    if (fclose(out) != 0 || failed || rename(temp_path, path) != 0) {
+        perror("Error writing index snapshot");
+        unlink(temp_path);
+        return -1;
+    }
+    index_snapshot.written = header.generation;
+    index_snapshot.current = 1;
+    printf("Saved index snapshot: %llu files, %llu directories in %.1f ms\n", (unsigned long long) header.file_count,
+           (unsigned long long) header.dir_count, elapsed_ms(&started));
+    return 0;
+}
+
+// Check that every section lies inside the file and every path inside the arena
+static int snapshot_valid(const struct snapshot_header *header, size_t length) {
+    const char *base = (const char *) header;
+    if (length < sizeof(*header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->length != length || header->file_count > length || header->dir_count > length) {
+        return 0;
+    }
+    uint64_t files = header->file_count;
+    uint64_t dirs = header->dir_count;
+    const uint64_t sections[][2] = {
+        {header->file_path, files * sizeof(uint64_t)}, {header->file_name, files * sizeof(uint16_t)},
+        {header->file_size, files * sizeof(int64_t)},  {header->file_mtime, files * sizeof(int64_t)},
+        {header->file_ctime, files * sizeof(int64_t)}, {header->dir_path, dirs * sizeof(uint64_t)},
+        {header->dir_ino, dirs * sizeof(uint64_t)},    {header->dir_mtime, dirs * 2 * sizeof(int64_t)},
+        {header->arena, header->arena_length}};
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (sections[i][0] % (i == 1 || i == 8 ? 1 : 8) != 0 || sections[i][0] > length ||
+            sections[i][1] > length - sections[i][0]) {
+            return 0;
+        }
+    }
+    const char *arena = base + header->arena;
+    if (header->arena_length == 0 || arena[header->arena_length - 1] != '\0' || header->root >= header->arena_length) {
+        return 0;
+    }
+    const uint64_t *file_path = (const uint64_t *) (base + header->file_path);
+    const uint16_t *file_name = (const uint16_t *) (base + header->file_name);
+    for (uint64_t i = 0; i < files; i++) {
+        if (file_path[i] >= header->arena_length || file_name[i] >= strlen(arena + file_path[i])) {
+            return 0;
+        }
+    }
+    const uint64_t *dir_path = (const uint64_t *) (base + header->dir_path);
+    for (uint64_t i = 0; i < dirs; i++) {
+        if (dir_path[i] >= header->arena_length) {
+            return 0;
+        }
+    }
+    return strcmp(arena + header->root, index_watch.root) == 0;
+}
+
+// Reread the entries of one directory whose mtime moved: refresh its files, and queue any
+// subdirectory the index has not seen for a rescan
+size_t reread_directory(const char *directory, struct path_list *rescans) {
+    size_t changes = 0;
+    watch_directory(directory);
+    DIR *dir = opendir(directory);
+    struct stat dir_stat;
+    if (dir == NULL || fstat(dirfd(dir), &dir_stat) != 0) {
+        if (dir != NULL) {
+            closedir(dir);
+        }
+        return 0;
+    }
+    dir_table_set(directory, dir_stat.st_ino, dir_stat.st_mtim);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        struct stat file_stat;
+        if (fstatat(dirfd(dir), entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISREG(file_stat.st_mode)) {
+            changes += index_update_file(path, file_stat.st_size, file_stat.st_mtime, file_stat.st_ctime);
+        } else if (S_ISDIR(file_stat.st_mode) &&
+                   (file_stat.st_ino != excluded_ino || file_stat.st_dev != excluded_dev)) {
+            const struct dir_record *known = dir_table_find(path);
+            if (known == NULL || known->path == NULL || known->ino == 0) {
+                path_list_add(rescans, path);
+            }
+        }
+    }
+    closedir(dir);
+    return changes;
+}
+
+// Bring a freshly loaded snapshot in line with the disk. A directory that is gone drops its
+// subtree; one with a new inode was replaced and is queued on rescans to be walked whole once the
+// lock is released; one whose mtime moved had entries created, removed or renamed, and only its
+// own entries are reread.
+size_t reconcile_snapshot(struct path_list *rescans) {
+    struct path_list dirs = {0};
+    for (size_t i = 0; i < file_index.dir_capacity; i++) {
+        if (file_index.dirs[i].path != NULL && file_index.dirs[i].ino != 0) {
+            path_list_add(&dirs, file_index.dirs[i].path);
+        }
+    }
+
+    size_t changes = 0;
+    size_t reread = 0;
+    for (const char *path = path_list_first(&dirs); path != NULL; path = path_list_next(&dirs, path)) {
+        // Looked up again each time: a removal above may have dropped it
+        struct dir_record *dir = dir_table_find(path);
+        if (dir == NULL || dir->path == NULL || dir->ino == 0 || dir->reread || path_list_covers(rescans, path)) {
+            continue;
+        }
+        struct stat dir_stat;
+        if (lstat(path, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+            changes += index_mark_tree(path, RECORD_LIVE, RECORD_REMOVED);
+            dir_table_remove_tree(path);
+        } else if (dir_stat.st_ino != dir->ino) {
+            path_list_add(rescans, path);
+        } else if (dir_stat.st_mtim.tv_sec != dir->mtime.tv_sec || dir_stat.st_mtim.tv_nsec != dir->mtime.tv_nsec) {
+            dir->reread = 1;
+            reread++;
+        } else {
+            watch_directory(path);
+        }
+    }
+
+    // A directory found before the replaced one it sits in is left to that rescan
+    for (const char *path = path_list_first(&dirs); path != NULL; path = path_list_next(&dirs, path)) {
+        struct dir_record *dir = dir_table_find(path);
+        if (dir != NULL && dir->path != NULL && dir->reread && path_list_covers(rescans, path)) {
+            dir->reread = 0;
+            reread--;
+        }
+    }
+
+    if (reread > 0) {
+        // Files directly in a reread directory stay unconfirmed unless the reread sees them
+        char parent[PATH_MAX];
+        for (size_t i = 0; i < file_index.count; i++) {
+            struct file_record *record = &file_index.files[i];
+            if (record->state != RECORD_LIVE || record->name == 0 || record->name > sizeof(parent)) {
+                continue;
+            }
+            memcpy(parent, record_path(record), record->name - 1);
+            parent[record->name - 1] = '\0';
+            const struct dir_record *dir = dir_table_find(parent);
+            if (dir != NULL && dir->path != NULL && dir->reread) {
+                record_set_state(record, RECORD_UNCONFIRMED);
+            }
+        }
+        for (const char *path = path_list_first(&dirs); path != NULL; path = path_list_next(&dirs, path)) {
+            struct dir_record *dir = dir_table_find(path);
+            if (dir != NULL && dir->path != NULL && dir->reread) {
+                dir->reread = 0;
+                changes += reread_directory(path, rescans);
+            }
+        }
+        for (size_t i = 0; i < file_index.count; i++) {
+            if (file_index.files[i].state == RECORD_UNCONFIRMED) {
+                record_set_state(&file_index.files[i], RECORD_REMOVED);
+                file_index.removed++;
+                changes++;
+            }
+        }
+    }
+    path_list_free(&dirs);
+    printf("Reconciled index snapshot: %zu directories reread, %zu changes\n", reread, changes);
+    return changes;
+}
+
+int every_record(const struct file_record *record, void *arg) {
+    (void) record;
+    (void) arg;
+    return 1;
+}
+
+// Writing a file in place moves its mtime but not its directory's, so after starting from a
+// snapshot every file is stat'ed once more in the background. Stale records are re-stat'ed
+// under the write lock, so a watcher update applied meanwhile is never rolled back.
+void *verify_snapshot_main(void *arg) {
+    (void) arg;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct path_list paths = {0};
+    index_select(every_record, NULL, &paths);
+
+    size_t changes = 0;
+    for (const char *path = path_list_first(&paths); path != NULL; path = path_list_next(&paths, path)) {
+        struct stat file_stat;
+        int exists = lstat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+        pthread_rwlock_rdlock(&file_index.lock);
+        const struct file_record *record = index_lookup(path);
+        int stale = record != NULL && record->state == RECORD_LIVE &&
+                    (!exists || record->size != file_stat.st_size || record->mtime != file_stat.st_mtime ||
+                     record->ctime != file_stat.st_ctime);
+        pthread_rwlock_unlock(&file_index.lock);
+        if (!stale) {
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&file_index.lock);
+        exists = lstat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+        int changed = exists ? index_update_file(path, file_stat.st_size, file_stat.st_mtime, file_stat.st_ctime)
+                             : index_remove_file(path);
+        if (changed) {
+            index_advance_generation();
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+        changes += changed;
+    }
+    printf("Verified %zu snapshot files in %.1f ms, %zu changed\n", paths.count, elapsed_ms(&started), changes);
+    path_list_free(&paths);
+    return NULL;
+}
+
+// Map the snapshot and load it; returns -1 when there is none or it does not fit this HOME
+int load_index_snapshot(void) {
+    char path[PATH_MAX];
+    if (snapshot_path(path, sizeof(path), "") != 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct stat snapshot_stat;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &snapshot_stat) == 0 && snapshot_stat.st_size >= (off_t) sizeof(struct snapshot_header)) {
+        mapping = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    const struct snapshot_header *header = mapping;
+    if (!snapshot_valid(header, snapshot_stat.st_size)) {
+        fprintf(stderr, "Ignoring index snapshot '%s': damaged or taken of another HOME\n", path);
+        munmap(mapping, snapshot_stat.st_size);
+        return -1;
+    }
+
+    const char *base = mapping;
+    const char *arena = base + header->arena;
+    const uint64_t *file_path = (const uint64_t *) (base + header->file_path);
+    const uint16_t *file_name = (const uint16_t *) (base + header->file_name);
+    const int64_t *file_size = (const int64_t *) (base + header->file_size);
+    const int64_t *file_mtime = (const int64_t *) (base + header->file_mtime);
+    const int64_t *file_ctime = (const int64_t *) (base + header->file_ctime);
+    const uint64_t *dir_path = (const uint64_t *) (base + header->dir_path);
+    const uint64_t *dir_ino = (const uint64_t *) (base + header->dir_ino);
+    const int64_t *dir_mtime = (const int64_t *) (base + header->dir_mtime);
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    for (uint64_t i = 0; i < header->file_count; i++) {
+        index_append(arena + file_path[i], file_name[i], file_size[i], file_mtime[i], file_ctime[i]);
+    }
+    for (uint64_t i = 0; i < header->dir_count; i++) {
+        struct timespec mtime = {dir_mtime[2 * i], dir_mtime[2 * i + 1]};
+        dir_table_set(arena + dir_path[i], dir_ino[i], mtime);
+    }
+    index_rebuild_orders();
+    file_index.generation = header->generation;
+    printf("Loaded index snapshot: %zu files in %.1f ms\n", file_index.count, elapsed_ms(&started));
+    index_snapshot.written = header->generation;
+    index_snapshot.current = 1;
+    munmap(mapping, snapshot_stat.st_size);
+
+    file_index.restored = 1;
+    struct path_list rescans = {0};
+    if (reconcile_snapshot(&rescans) > 0) {
+        index_advance_generation();
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    for (const char *path = path_list_first(&rescans); path != NULL; path = path_list_next(&rescans, path)) {
+        rescan_tree(path);
+    }
+    path_list_free(&rescans);
+    printf("Index ready in %.1f ms\n", elapsed_ms(&started));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, verify_snapshot_main, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+// Save the index every SNAPSHOT_INTERVAL seconds when it changed, and once more on SIGINT or
+// SIGTERM before exiting. Every other thread blocks those signals, so they all arrive here.
+void *snapshot_main(void *arg) {
+    (void) arg;
+    for (;;) {
+        if (!index_snapshot.current || index_generation() != index_snapshot.written) {
+            write_index_snapshot();
+        }
+        struct timespec interval = {SNAPSHOT_INTERVAL, 0};
+        int signal_number = sigtimedwait(&index_snapshot.signals, NULL, &interval);
+        if (signal_number > 0) {
+            if (index_generation() != index_snapshot.written || !index_snapshot.current) {
+                write_index_snapshot();
+            }
+            printf("Exiting on signal %d\n", signal_number);
+            exit(0);
+        }
+    }
+}
+
+// Must run before any other thread starts, so they all inherit the blocked shutdown signals
+void block_shutdown_signals(void) {
+    sigemptyset(&index_snapshot.signals);
+    sigaddset(&index_snapshot.signals, SIGINT);
+    sigaddset(&index_snapshot.signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &index_snapshot.signals, NULL);
+}
+
+void start_snapshot_writer(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, snapshot_main, NULL) != 0) {
+        perror("Error starting snapshot writer");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+// -------------------------- handle_fgets_command ------------------------
+
+// fgets names are matched exactly against base names, like find -name without wildcards
+// Requested base names in a small open-addressed table, so one pass over the index answers every
+// name at once with a hash and usually a single compare per file
+#define NAME_SET_SLOTS 16 // a power of two, over twice the most names fgets takes
+
+struct name_set {
+    const char *slots[NAME_SET_SLOTS];
+};
+
+void name_set_add(struct name_set *set, const char *name) {
+    size_t slot = fnv1a(FNV_OFFSET, name, strlen(name)) & (NAME_SET_SLOTS - 1);
+    while (set->slots[slot] != NULL && strcmp(set->slots[slot], name) != 0) {
+        slot = (slot + 1) & (NAME_SET_SLOTS - 1);
+    }
+    set->slots[slot] = name;
+}
+
+int name_matches(const struct file_record *record, void *arg) {
+    const struct name_set *set = arg;
+    const char *name = record_name(record);
+    for (size_t slot = fnv1a(FNV_OFFSET, name, strlen(name)) & (NAME_SET_SLOTS - 1); set->slots[slot] != NULL;
+         slot = (slot + 1) & (NAME_SET_SLOTS - 1)) {
+        if (strcmp(set->slots[slot], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void handle_fgets_command(char *arguments, char *response, const struct codec_choice *codec,
+                          const struct reply_channel *client) {
+    char *saveptr = NULL;
+    // Tokenize the space-separated file names from the arguments
+    char *file_name = strtok_r(arguments, " ", &saveptr);
+    char *files[4]; // Assuming the maximum of 4 files in fgets command
+    int num_files = 0;
+
+    while (file_name != NULL && num_files < 4) {
+        printf("%s\n", file_name);
+        files[num_files] = file_name;
+        num_files++;
+        file_name = strtok_r(NULL, " ", &saveptr);
+    }
+
+    if (num_files == 0) {
+        // No files specified in the command
+        sprintf(response, "No files specified");
+        return;
+    }
+
+    struct archive_stream stream;
+    struct path_list matches = {0};
+    struct name_set names = {0};
+    for (int i = 0; i < num_files; i++) {
+        name_set_add(&names, files[i]);
+    }
+    archive_stream_init(&stream, client, codec);
+    index_select(name_matches, &names, &matches);
+    archive_paths(&stream, &matches);
+    path_list_free(&matches);
+    archive_stream_respond(&stream, response);
+}
+
+// ----------------------------handle_tarfgetz_command------------------------------------
+
+void handle_tarfgetz_command(char *arguments, char *response, const struct codec_choice *codec,
+                             const struct reply_channel *client) {
+    char *saveptr = NULL;
+    // Tokenize the space-separated arguments
+    char *size1_str = strtok_r(arguments, " ", &saveptr);
+    char *size2_str = strtok_r(NULL, " ", &saveptr);
+
+    if (size1_str == NULL || size2_str == NULL) {
+        sprintf(response, "Invalid arguments");
+        return;
+    }
+
+    // Convert size1 and size2 to integers
+    int size1 = atoi(size1_str);
+    int size2 = atoi(size2_str);
+
+    if (size1 < 0 || size2 < 0 || size1 > size2) {
+        sprintf(response, "Invalid size criteria");
+        return;
+    }
+
+    char query[64];
+    snprintf(query, sizeof(query), "tarfgetz %d %d", size1, size2);
+
+    struct archive_stream stream;
+    struct cache_fill fill;
+    archive_stream_init(&stream, client, codec);
+    if (archive_cache_begin(&fill, query, &stream, response) == 0) {
+        // Same test as find -size +Nk -size -Mk, which rounds sizes up to whole KiB:
+        // size1 < ceil(bytes / 1024) < size2
+        struct path_list matches = {0};
+        unsigned long long total;
+        index_select_size(size1 * 1024LL + 1, (size2 - 1) * 1024LL, &matches, &total);
+        printf("tarfgetz %d %d: %zu files, %llu bytes\n", size1, size2, matches.count, total);
+        archive_paths(&stream, &matches);
+        path_list_free(&matches);
+        archive_cache_finish(&fill, &stream, response);
+    }
+}
+
+// ---------------------------------handle_filesrch_command---------------------------------
+
+void format_creation_time(time_t ctime, char *formatted_time) {
+    struct tm timeinfo;
+    localtime_r(&ctime, &timeinfo);
+    strftime(formatted_time, 20, "%b %d %H:%M", &timeinfo);
+}
+
+#define FILESRCH_TRAILER 80
+
+// filesrch -g <glob> | -r <regex> [start]: every match from the start-th on, one per line with
+// size and ctime, as many as fit in one response, then where the next page starts
+void handle_filesrch_pages(const char *mode, char *saveptr, char *response) {
+    char *pattern = strtok_r(NULL, " ", &saveptr);
+    char *start_str = strtok_r(NULL, " ", &saveptr);
+    char *end = NULL;
+    unsigned long long start = start_str != NULL ? strtoull(start_str, &end, 10) : 0;
+    if (pattern == NULL || (start_str != NULL && (*end != '\0' || !isdigit((unsigned char) start_str[0])))) {
+        sprintf(response, "Usage: filesrch %s pattern <start>", mode);
+        return;
+    }
+    struct name_search search;
+    if (name_search_init(&search, pattern, strcmp(mode, "-r") == 0) != 0) {
+        sprintf(response, "Invalid regex");
+        return;
+    }
+
+    size_t total = 0;
+    size_t shown = 0;
+    size_t length = 0;
+    int full = 0;
+    pthread_rwlock_rdlock(&file_index.lock);
+    for (size_t i = name_search_next(&search, 0); i < file_index.count; i = name_search_next(&search, i + 1)) {
+        if (total++ < start || full) {
+            continue;
+        }
+        const struct file_record *record = &file_index.files[i];
+        char formatted_time[20];
+        format_creation_time(record->ctime, formatted_time);
+        size_t room = BUFFER_SIZE - FILESRCH_TRAILER - length;
+        int written = snprintf(response + length, room, "%s %lld %s\n", record_path(record), record->size,
+                               formatted_time);
+        if (written < 0 || (size_t) written >= room) {
+            // A path too long for a page of its own is shown cut short
+            full = 1;
+            if (shown > 0) {
+                response[length] = '\0';
+                continue;
+            }
+            written = room - 1;
+        }
+        length += written;
+        shown++;
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    name_search_free(&search);
+
+    if (total == 0) {
+        sprintf(response, "File not found");
+    } else if (shown == 0) {
+        sprintf(response, "No matches from %llu; %zu in all", start, total);
+    } else {
+        length += snprintf(response + length, BUFFER_SIZE - length, "Matches %llu-%llu of %zu", start + 1,
+                           start + shown, total);
+        if (start + shown < total) {
+            snprintf(response + length, BUFFER_SIZE - length, "; next page: start %llu", start + shown);
+        }
+    }
+}
+
+void handle_filesrch_command(char *arguments, char *response) {
+    char *saveptr = NULL;
+    // Tokenize the command arguments to get the filename
+    char *filename = strtok_r(arguments, " ", &saveptr);
+    if (filename == NULL) {
         sprintf(response, "No filename specified");
-        send(client_socket, &start_flag, sizeof(int), 0);
+        return;
+    }
+    if (strcmp(filename, "-g") == 0 || strcmp(filename, "-r") == 0) {
+        handle_filesrch_pages(filename, saveptr, response);
         return;
     }
 
-    // Get the user's home directory
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        sprintf(response, "Unable to get home directory");
-        send(client_socket, &start_flag, sizeof(int), 0);
+    // First match in walk order, like find -name <pattern> | head -n 1, and no further: the search
+    // stops at the first hit. Size and ctime come from the index too.
+    struct name_search search;
+    name_search_init(&search, filename, 0);
+    struct file_record found = {0};
+    int status = -1;
+    pthread_rwlock_rdlock(&file_index.lock);
+    size_t record = name_search_next(&search, 0);
+    if (record < file_index.count) {
+        found = file_index.files[record];
+        status = 0;
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    if (status != 0) {
+        sprintf(response, "File not found");
+        return;
+    }
+
+    // Convert the st_ctime value to formatted creation time
+    char formatted_time[20];
+    format_creation_time(found.ctime, formatted_time);
+
+    // Format the response with filename, size, and formatted creation time
+    sprintf(response, "%s %lld %s", filename, found.size, formatted_time);
+}
+
+// -------------------------------handle_targzf_command---------------------------------------------
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+void handle_targzf_command(char *arguments, char *response, const struct codec_choice *codec,
+                           const struct reply_channel *client) {
+    char *saveptr = NULL;
+    // Tokenize the space-separated arguments
+    char *extension_list = strtok_r(arguments, " ", &saveptr);
+
+    if (extension_list == NULL) {
+        sprintf(response, "Invalid arguments");
+        return;
+    }
+
+    // Any number of extensions; a command is at most BUFFER_SIZE bytes, so there are fewer words
+    char *extensions[BUFFER_SIZE / 2];
+    int num_extensions = 0;
+
+    while (extension_list != NULL) {
+        extensions[num_extensions] = extension_list;
+        num_extensions++;
+        extension_list = strtok_r(NULL, " ", &saveptr);
+    }
+
+    // The same set of extensions in any order is the same query
+    qsort(extensions, num_extensions, sizeof(char *), compare_strings);
+    char query[BUFFER_SIZE + sizeof("targzf")] = "targzf";
+    size_t query_length = strlen(query);
+    int num_distinct = 0;
+    for (int i = 0; i < num_extensions; i++) {
+        if (i == 0 || strcmp(extensions[i], extensions[i - 1]) != 0) {
+            query_length += snprintf(query + query_length, sizeof(query) - query_length, " %s", extensions[i]);
+            extensions[num_distinct++] = extensions[i];
+        }
+    }
+
+    struct archive_stream stream;
+    struct cache_fill fill;
+    archive_stream_init(&stream, client, codec);
+    if (archive_cache_begin(&fill, query, &stream, response) == 0) {
+        struct path_list matches = {0};
+        index_select_extensions(extensions, num_distinct, &matches);
+        archive_paths(&stream, &matches);
+        path_list_free(&matches);
+        archive_cache_finish(&fill, &stream, response);
+    }
+}
+
+struct date_filter {
+    time_t after;
+    time_t until;
+};
+
+// Midnight local time at the start of a YYYY-MM-DD date, as find -newermt reads it
+int parse_day(const char *date, time_t *day) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, "%Y-%m-%d", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    *day = mktime(&tm);
+    return *day == (time_t) -1 ? -1 : 0;
+}
+
+void handle_getdirf_command(char *arguments, char *response, const struct codec_choice *codec,
+                            const struct reply_channel *client) {
+    char *saveptr = NULL;
+    // Tokenize the command arguments
+    char *date1 = strtok_r(arguments, " ", &saveptr);
+    char *date2 = strtok_r(NULL, " ", &saveptr);
+
+    if (date1 == NULL || date2 == NULL) {
+        sprintf(response, "Invalid arguments");
+        return;
+    }
+
+    struct date_filter filter = {0, 0};
+    if (parse_day(date1, &filter.after) != 0 || parse_day(date2, &filter.until) != 0) {
+        sprintf(response, "Invalid date format");
+        return;
+    }
+
+    char query[64];
+    snprintf(query, sizeof(query), "getdirf %lld %lld", (long long) filter.after, (long long) filter.until);
+
+    struct archive_stream stream;
+    struct cache_fill fill;
+    archive_stream_init(&stream, client, codec);
+    if (archive_cache_begin(&fill, query, &stream, response) == 0) {
+        // -newermt date1 ! -newermt date2
+        struct path_list matches = {0};
+        index_select_mtime(filter.after, filter.until, &matches);
+        archive_paths(&stream, &matches);
+        path_list_free(&matches);
+        archive_cache_finish(&fill, &stream, response);
+    }
+}
+
+// -------------------------------handle_query_command---------------------------------------------
+
+// query [size size1 size2] [date date1 date2] [ext ext1,ext2,...] [name pattern]: one archive of the
+// files that pass every predicate given, each read as tarfgetz, getdirf, targzf and filesrch read it
+void handle_query_command(char *arguments, char *response, const struct codec_choice *codec,
+                          const struct reply_channel *client) {
+    char *saveptr = NULL;
+    struct column_filter filter;
+    memset(&filter, 0, sizeof(filter));
+    char *extensions[BUFFER_SIZE / 2];
+    filter.extensions = extensions;
+    int size1 = 0;
+    int size2 = 0;
+    int valid = arguments != NULL;
+
+    char *keyword = valid ? strtok_r(arguments, " ", &saveptr) : NULL;
+    for (; keyword != NULL && valid; keyword = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(keyword, "size") == 0 && !filter.by_size) {
+            char *size1_str = strtok_r(NULL, " ", &saveptr);
+            char *size2_str = strtok_r(NULL, " ", &saveptr);
+            valid = size1_str != NULL && size2_str != NULL;
+            if (valid) {
+                size1 = atoi(size1_str);
+                size2 = atoi(size2_str);
+                valid = size1 >= 0 && size2 >= 0 && size1 <= size2;
+            }
+            // size1 < ceil(bytes / 1024) < size2, as in tarfgetz
+            filter.by_size = 1;
+            filter.min_size = size1 * 1024LL + 1;
+            filter.max_size = (size2 - 1) * 1024LL;
+        } else if (strcmp(keyword, "date") == 0 && !filter.by_mtime) {
+            char *date1 = strtok_r(NULL, " ", &saveptr);
+            char *date2 = strtok_r(NULL, " ", &saveptr);
+            valid = date1 != NULL && date2 != NULL && parse_day(date1, &filter.after) == 0 &&
+                    parse_day(date2, &filter.until) == 0;
+            filter.by_mtime = 1;
+        } else if (strcmp(keyword, "ext") == 0 && filter.num_extensions == 0) {
+            char *list = strtok_r(NULL, " ", &saveptr);
+            char *list_saveptr;
+            for (char *extension = list != NULL ? strtok_r(list, ",", &list_saveptr) : NULL; extension != NULL;
+                 extension = strtok_r(NULL, ",", &list_saveptr)) {
+                extensions[filter.num_extensions++] = extension;
+            }
+            valid = filter.num_extensions > 0;
+        } else if (strcmp(keyword, "name") == 0 && filter.pattern == NULL) {
+            filter.pattern = strtok_r(NULL, " ", &saveptr);
+            valid = filter.pattern != NULL;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid || (!filter.by_size && !filter.by_mtime && filter.num_extensions == 0 && filter.pattern == NULL)) {
+        sprintf(response, "Invalid query");
         return;
     }
 
-    // Create a buffer to store the full path to the target file
-    char target_path[PATH_MAX];
+    // Predicates in a fixed order and extensions sorted, so the same conjunction is one cache entry
+    qsort(extensions, filter.num_extensions, sizeof(char *), compare_strings);
+    char query[2 * BUFFER_SIZE] = "query";
+    size_t query_length = strlen(query);
+    if (filter.by_size) {
+        query_length += snprintf(query + query_length, sizeof(query) - query_length, " size %d %d", size1, size2);
+    }
+    if (filter.by_mtime) {
+        query_length += snprintf(query + query_length, sizeof(query) - query_length, " date %lld %lld",
+                                 (long long) filter.after, (long long) filter.until);
+    }
+    int num_distinct = 0;
+    for (int i = 0; i < filter.num_extensions; i++) {
+        if (i == 0 || strcmp(extensions[i], extensions[i - 1]) != 0) {
+            query_length += snprintf(query + query_length, sizeof(query) - query_length, "%s%s",
+                                     num_distinct == 0 ? " ext " : ",", extensions[i]);
+            extensions[num_distinct++] = extensions[i];
+        }
+    }
+    filter.num_extensions = num_distinct;
+    if (filter.pattern != NULL) {
+        snprintf(query + query_length, sizeof(query) - query_length, " name %s", filter.pattern);
+    }
+
+    struct archive_stream stream;
+    struct cache_fill fill;
+    archive_stream_init(&stream, client, codec);
+    if (archive_cache_begin(&fill, query, &stream, response) == 0) {
+        struct path_list matches = {0};
+        unsigned long long total;
+        index_select_filter(&filter, &matches, &total);
+        printf("%s: %zu files, %llu bytes\n", query, matches.count, total);
+        archive_paths(&stream, &matches);
+        path_list_free(&matches);
+        archive_cache_finish(&fill, &stream, response);
+    }
+}
+
+// ---------------------------------------- load balancing ----------------------------------------
+
+#define EWMA_ALPHA 0.2
+#define PROBE_INTERVAL_MS 500
+#define PROBE_TIMEOUT_MS 1000
+
+enum balance_policy {
+    BALANCE_LEAST_OUTSTANDING,
+    BALANCE_EWMA_LATENCY
+};
+
+// Live view of one side of the split: sessions it is serving and how fast it answers
+struct backend {
+    const char *name;
+    int outstanding;
+    double ewma_ms;
+    double rtt_ms;
+    int healthy;
+};
+
+static struct backend local_backend = {.name = "server", .ewma_ms = 1.0, .healthy = 1};
+static struct backend mirror_backend = {.name = "mirror", .ewma_ms = 1.0};
+static pthread_mutex_t balancer_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum balance_policy balance_policy = BALANCE_LEAST_OUTSTANDING;
+static char *mirror_ip;
+static int mirror_port;
+
+double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void local_session_delta(int delta) {
+    pthread_mutex_lock(&balancer_lock);
+    local_backend.outstanding += delta;
+    pthread_mutex_unlock(&balancer_lock);
+}
+
+void record_local_latency(double ms) {
+    pthread_mutex_lock(&balancer_lock);
+    local_backend.ewma_ms = EWMA_ALPHA * ms + (1 - EWMA_ALPHA) * local_backend.ewma_ms;
+    pthread_mutex_unlock(&balancer_lock);
+}
+
+// Expected wait for a new session: every queued session ahead of it costs one smoothed reply
+double backend_cost(const struct backend *backend) {
+    if (balance_policy == BALANCE_EWMA_LATENCY) {
+        return (backend->ewma_ms + backend->rtt_ms) * (backend->outstanding + 1);
+    }
+    return backend->outstanding;
+}
+
+// Decide where a new connection goes; returns 1 to forward it to the mirror
+int route_to_mirror(void) {
+    int forward = 0;
+    pthread_mutex_lock(&balancer_lock);
+    if (mirror_backend.healthy && backend_cost(&mirror_backend) < backend_cost(&local_backend)) {
+        // Count it now so a burst between two probes does not all land on the mirror
+        mirror_backend.outstanding++;
+        forward = 1;
+    }
+    pthread_mutex_unlock(&balancer_lock);
+    return forward;
+}
+
+int connect_to_mirror(void) {
+    struct sockaddr_in mirror_addr;
+    memset(&mirror_addr, 0, sizeof(mirror_addr));
+    mirror_addr.sin_family = AF_INET;
+    mirror_addr.sin_port = htons((uint16_t) mirror_port);
+    if (inet_pton(AF_INET, mirror_ip, &mirror_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid mirror address '%s'\n", mirror_ip);
+        return -1;
+    }
+
+    int mirror_sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (mirror_sd < 0) {
+        return -1;
+    }
+
+    // Bound the connect so a dead mirror cannot stall the caller, then clear the timeout again
+    struct timeval timeout = {.tv_sec = PROBE_TIMEOUT_MS / 1000, .tv_usec = (PROBE_TIMEOUT_MS % 1000) * 1000};
+    struct timeval no_timeout = {0};
+    setsockopt(mirror_sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(mirror_sd, (struct sockaddr *) &mirror_addr, sizeof(mirror_addr)) < 0) {
+        close(mirror_sd);
+        return -1;
+    }
+    setsockopt(mirror_sd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof(no_timeout));
+    return mirror_sd;
+}
+
+// ---------------------------------------- upstream pool ----------------------------------------
+
+#define UPSTREAM_POOL_SIZE 8
+
+// Idle, already-connected mirror sessions kept warm by the balancer thread. A forwarded client
+// borrows one for its whole session and hands it back once every command it sent is answered,
+// so forwarding skips the handshake on the accept path.
+static int upstream_idle[UPSTREAM_POOL_SIZE];
+static int upstream_idle_count;
+static pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// An idle session is healthy when the mirror has neither closed it nor left unread bytes on it
+int upstream_is_clean(int mirror_sd) {
+    char byte;
+    ssize_t peeked = recv(mirror_sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_acquire(void) {
+    while (1) {
+        pthread_mutex_lock(&upstream_lock);
+        int mirror_sd = upstream_idle_count > 0 ? upstream_idle[--upstream_idle_count] : -1;
+        pthread_mutex_unlock(&upstream_lock);
+
+        if (mirror_sd < 0) {
+            return connect_to_mirror();
+        }
+        if (upstream_is_clean(mirror_sd)) {
+            return mirror_sd;
+        }
+        close(mirror_sd);
+    }
+}
+
+void upstream_release(int mirror_sd) {
+    fcntl(mirror_sd, F_SETFL, fcntl(mirror_sd, F_GETFL) & ~O_NONBLOCK);
+    if (upstream_is_clean(mirror_sd)) {
+        pthread_mutex_lock(&upstream_lock);
+        if (upstream_idle_count < UPSTREAM_POOL_SIZE) {
+            upstream_idle[upstream_idle_count++] = mirror_sd;
+            mirror_sd = -1;
+        }
+        pthread_mutex_unlock(&upstream_lock);
+    }
+    if (mirror_sd >= 0) {
+        close(mirror_sd);
+    }
+}
 
-    // Use the find command to search for the file
-    char find_command[256];
-    snprintf(find_command, sizeof(find_command), "find %s -type f -name %s | head -n 1", home_dir, filename);
+int upstream_idle_sessions(void) {
+    pthread_mutex_lock(&upstream_lock);
+    int idle = upstream_idle_count;
+    pthread_mutex_unlock(&upstream_lock);
+    return idle;
+}
 
-    FILE *find_output = popen(find_command, "r");
-    if (find_output == NULL) {
-        sprintf(response, "Error searching for file");
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+// Drop idle sessions the mirror has closed, then top the pool back up
+void upstream_maintain(void) {
+    pthread_mutex_lock(&upstream_lock);
+    int kept = 0;
+    for (int i = 0; i < upstream_idle_count; i++) {
+        if (upstream_is_clean(upstream_idle[i])) {
+            upstream_idle[kept++] = upstream_idle[i];
+        } else {
+            close(upstream_idle[i]);
+        }
     }
+    upstream_idle_count = kept;
+    int missing = UPSTREAM_POOL_SIZE - upstream_idle_count;
+    pthread_mutex_unlock(&upstream_lock);
 
-    // Read the first line of the find command output, which should be the path to the file
-    if (fgets(target_path, sizeof(target_path), find_output) == NULL) {
-        pclose(find_output);
-        sprintf(response, "File not found");
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+    for (int i = 0; i < missing; i++) {
+        int mirror_sd = connect_to_mirror();
+        if (mirror_sd < 0) {
+            break;
+        }
+        upstream_release(mirror_sd);
     }
+}
 
-    // Remove the newline character from the path
-    target_path[strlen(target_path) - 1] = '\0';
-
-    // Close the find command output pipe
-    pclose(find_output);
+void upstream_drain(void) {
+    pthread_mutex_lock(&upstream_lock);
+    for (int i = 0; i < upstream_idle_count; i++) {
+        close(upstream_idle[i]);
+    }
+    upstream_idle_count = 0;
+    pthread_mutex_unlock(&upstream_lock);
+}
 
+// ---------------------------------------- mirror probes ----------------------------------------
 
+// Ask the mirror for its live load over a pooled session: "<sessions> <ewma_ms>"
+int probe_mirror(int *sessions, double *ewma_ms, double *rtt_ms) {
+    int mirror_sd = upstream_acquire();
+    if (mirror_sd < 0) {
+        return -1;
+    }
 
-    // Get file size and creation time
-    struct stat file_stat;
-    if (stat(target_path, &file_stat) != 0) {
-        send(client_socket, &start_flag, sizeof(int), 0);
-        sprintf(response, "Error getting file information");
-        return;
+    struct timeval timeout = {.tv_sec = PROBE_TIMEOUT_MS / 1000, .tv_usec = (PROBE_TIMEOUT_MS % 1000) * 1000};
+    struct timeval no_timeout = {0};
+    setsockopt(mirror_sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    char report[64];
+    struct frame_header header;
+    int status = -1;
+    if (send_frame(mirror_sd, FRAME_COMMAND, 0, 0, "load", 4) == 0) {
+        status = recv_frame(mirror_sd, &header, report, sizeof(report) - 1);
     }
+    *rtt_ms = elapsed_ms(&started);
 
-    // Convert the st_ctime value to formatted creation time
-    char formatted_time[20];
-    format_creation_time(file_stat.st_ctime, formatted_time);
+    if (status != 0 || header.type != FRAME_RESPONSE) {
+        close(mirror_sd);
+        return -1;
+    }
+    report[header.length] = '\0';
+    if (sscanf(report, "%d %lf", sessions, ewma_ms) != 2) {
+        close(mirror_sd);
+        return -1;
+    }
 
-    // Format the response with filename, size, and formatted creation time
-    sprintf(response, "%s %lld %s", filename, (long long) file_stat.st_size, formatted_time);
-    send(client_socket, &start_flag, sizeof(int), 0);
+    // The mirror counts our idle pooled sessions as its own; they are not load
+    *sessions -= upstream_idle_sessions();
+    if (*sessions < 0) {
+        *sessions = 0;
+    }
+    setsockopt(mirror_sd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    upstream_release(mirror_sd);
+    return 0;
 }
 
-// -------------------------------handle_targzf_command---------------------------------------------
+void *balancer_main(void *arg) {
+    (void) arg;
+    while (1) {
+        int sessions;
+        double ewma_ms, rtt_ms;
+        int status = probe_mirror(&sessions, &ewma_ms, &rtt_ms);
+
+        pthread_mutex_lock(&balancer_lock);
+        if (status == 0) {
+            if (!mirror_backend.healthy) {
+                printf("mirror %s:%d is up\n", mirror_ip, mirror_port);
+            }
+            mirror_backend.healthy = 1;
+            mirror_backend.outstanding = sessions;
+            mirror_backend.ewma_ms = ewma_ms;
+            mirror_backend.rtt_ms = EWMA_ALPHA * rtt_ms + (1 - EWMA_ALPHA) * mirror_backend.rtt_ms;
+        } else {
+            if (mirror_backend.healthy) {
+                printf("mirror %s:%d is down, serving everything locally\n", mirror_ip, mirror_port);
+            }
+            mirror_backend.healthy = 0;
+        }
+        pthread_mutex_unlock(&balancer_lock);
 
-void handle_targzf_command(char *arguments, char *response, pid_t pro_id, int client_socket) {
-    // Tokenize the space-separated arguments
-    char *extension_list = strtok(arguments, " ");
-    int start_flag = 1;
+        if (status == 0) {
+            upstream_maintain();
+        } else {
+            upstream_drain();
+        }
 
-    // Create the directory if it doesn't exist
-    char dir_name[PATH_MAX];
-    snprintf(dir_name, sizeof(dir_name), "%d", pro_id);
-    if (mkdir(dir_name, 0777) != 0 && errno != EEXIST) {
-        perror("Error creating directory");
-        sprintf(response, "Error creating directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+        usleep(PROBE_INTERVAL_MS * 1000);
     }
+    return NULL;
+}
 
-    if (extension_list == NULL) {
-        sprintf(response, "Invalid arguments");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+void start_balancer(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, balancer_main, NULL) != 0) {
+        perror("Error starting balancer");
+        exit(1);
     }
+    pthread_detach(thread);
+}
 
-    // Extract file extensions from the extension list
-    char *extensions[6]; // Assuming maximum of 6 extensions
-    int num_extensions = 0;
+// ---------------------------------------- event loop ----------------------------------------
 
-    while (extension_list != NULL && num_extensions < 6) {
-        extensions[num_extensions] = extension_list;
-        num_extensions++;
-        extension_list = strtok(NULL, " ");
-    }
+// Each client connection moves through these states; the socket is only armed in epoll while
+// it is waiting for a command, so a connection is owned by exactly one thread at a time.
+enum conn_state {
+    CONN_READ_COMMAND,
+    CONN_BUSY,
+    CONN_CLOSED
+};
+
+struct client_conn {
+    int socket;
+    int conn_id;
+    int epoll_fd;
+    enum conn_state state;
+    uint32_t request_id;  // of the command in buffer
+    size_t received;      // bytes of the next command frame read so far
+    unsigned char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    char buffer[BUFFER_SIZE + 1];
+};
 
-    char *unzip_flag = strtok(NULL, " ");
+// Bounded ring of queued connections; the owning worker takes the oldest job from the head
+// and idle workers steal the newest from the tail, so the two ends rarely contend.
+struct work_deque {
+    pthread_mutex_t lock;
+    struct client_conn *jobs[DEQUE_CAPACITY];
+    unsigned int head;
+    unsigned int tail;
+};
 
-    if (num_extensions == 0) {
-        // No extensions specified in the command
-        sprintf(response, "No file extensions specified");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
-    }
+struct worker_pool {
+    const char *name;
+    int num_workers;
+    struct work_deque *deques;
+    unsigned int next_deque;
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+struct worker_arg {
+    struct worker_pool *pool;
+    int index;
+};
 
-    char file_list_path[PATH_MAX];
-    snprintf(file_list_path, sizeof(file_list_path), "%s/%s", dir_name, "file_list.txt");
-    // Create a temporary TAR file name
-    char tar_name[PATH_MAX];
-    snprintf(tar_name, sizeof(tar_name), "%s/temp.tar.gz", dir_name);
+// Archive builds are CPU and disk heavy and get one worker per core; filesrch answers are
+// cheap and get their own small pool so they never queue behind a burst of archives.
+static struct worker_pool archive_pool = {.name = "archive"};
+static struct worker_pool query_pool = {.name = "query"};
 
-    // Create a temporary file to store the list of files to archive
-    FILE *file_list = fopen(file_list_path, "w");
-    if (file_list == NULL) {
-        sprintf(response, "Error creating file list");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+static int event_loop_fds[EVENT_LOOPS];
+static int next_conn_id = 1;
+
+void close_conn(struct client_conn *conn) {
+    local_session_delta(-1);
+    conn->state = CONN_CLOSED;
+    close(conn->socket);
+    free(conn);
+}
+
+// Re-arm the one-shot epoll registration so the next command wakes an event loop
+void rearm_conn(struct client_conn *conn) {
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+    conn->state = CONN_READ_COMMAND;
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event) < 0) {
+        perror("Error re-arming client connection");
+        close_conn(conn);
     }
+}
 
+int deque_push(struct work_deque *deque, struct client_conn *conn) {
+    int pushed = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head < DEQUE_CAPACITY) {
+        deque->jobs[deque->tail % DEQUE_CAPACITY] = conn;
+        deque->tail++;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
 
-    // Get the user's home directory
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        sprintf(response, "Unable to get home directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        fclose(file_list);
-        return;
+struct client_conn *deque_pop(struct work_deque *deque) {
+    struct client_conn *conn = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head != deque->tail) {
+        conn = deque->jobs[deque->head % DEQUE_CAPACITY];
+        deque->head++;
     }
+    pthread_mutex_unlock(&deque->lock);
+    return conn;
+}
 
-    // Use the find command to search for files with specified extensions
-    char find_command[256];
-    snprintf(find_command, sizeof(find_command), "find %s -type f ", home_dir);
+// Thieves take from the head too: the oldest queued command has waited longest
+struct client_conn *deque_steal(struct work_deque *deque) {
+    return deque_pop(deque);
+}
 
-    for (int i = 0; i < num_extensions; i++) {
-        if (i > 0) {
-            strcat(find_command, "-o ");
+// Queue a connection on the pool; returns -1 when every deque is full
+int submit_job(struct worker_pool *pool, struct client_conn *conn) {
+    unsigned int start = __atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (deque_push(&pool->deques[(start + i) % pool->num_workers], conn)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->pending++;
+            pthread_cond_signal(&pool->ready);
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
         }
-        strcat(find_command, "-name '*.");
-        strcat(find_command, extensions[i]);
-        strcat(find_command, "' ");
     }
+    return -1;
+}
 
+// Take a job from the worker's own deque, or steal one from a sibling
+struct client_conn *next_job(struct worker_pool *pool, int index) {
+    struct client_conn *conn = deque_pop(&pool->deques[index]);
+    for (int i = 1; conn == NULL && i < pool->num_workers; i++) {
+        conn = deque_steal(&pool->deques[(index + i) % pool->num_workers]);
+    }
+    return conn;
+}
 
-    strcat(find_command, " > ");
-    strcat(find_command, file_list_path);
-    // Execute the find command to generate the file list
+// Run one parsed command to completion; called from a worker thread
+void execute_command(struct client_conn *conn) {
+    char *saveptr = NULL;
+    struct reply_channel client = {conn->socket, conn->request_id};
+    int flags = 0;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-    if (system(find_command) != 0) {
-        sprintf(response, "No files found");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+    // Process the client command and send appropriate responses
+    char response[BUFFER_SIZE] = {0};
+
+    // Tokenize the command to extract the command type and arguments
+    char *command_type = strtok_r(conn->buffer, " ", &saveptr);
+    char *arguments = strtok_r(NULL, "", &saveptr);
+
+    struct codec_choice codec;
+    if (arguments == NULL) {
+        // Every command that reaches a worker needs at least one argument
+        sprintf(response, "Invalid arguments");
+        flags = FRAME_FLAG_ERROR;
+    } else if (take_codec_option(arguments, &codec) != 0) {
+        sprintf(response, "Unsupported codec");
+        flags = FRAME_FLAG_ERROR;
+    } else if (strcmp(command_type, "fgets") == 0) {
+        handle_fgets_command(arguments, response, &codec, &client);
+    } else if (strcmp(command_type, "tarfgetz") == 0) {
+        handle_tarfgetz_command(arguments, response, &codec, &client);
+    } else if (strcmp(command_type, "filesrch") == 0) {
+        handle_filesrch_command(arguments, response);
+    } else if (strcmp(command_type, "targzf") == 0) {
+        handle_targzf_command(arguments, response, &codec, &client);
+    } else if (strcmp(command_type, "getdirf") == 0) {
+        handle_getdirf_command(arguments, response, &codec, &client);
+    } else if (strcmp(command_type, "query") == 0) {
+        handle_query_command(arguments, response, &codec, &client);
     }
 
-    // Close the file
-    fclose(file_list);
+    // Send the response back to the client; it ends the reply
+    printf("%s", response);
+    send_frame(client.socket, FRAME_RESPONSE, flags, client.request_id, response, strlen(response));
+    record_local_latency(elapsed_ms(&started));
+}
 
-    // Create the TAR archive using the file list
-    char tar_command[PATH_MAX + 50];
-    snprintf(tar_command, sizeof(tar_command), "tar czf %s -T %s", tar_name, file_list_path);
-    if (system(tar_command) != 0) {
-        sprintf(response, "Error creating TAR archive");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+void *worker_main(void *arg) {
+    struct worker_pool *pool = ((struct worker_arg *) arg)->pool;
+    int index = ((struct worker_arg *) arg)->index;
+    free(arg);
+
+    while (1) {
+        // Sleep until a job is queued somewhere in the pool
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        // Claim one queued job before looking for it, so no two workers chase the same one
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+
+        // The claimed job is in some deque; a scan can only miss it when another claimer
+        // takes the job we were heading for, and then the one left over is still there
+        struct client_conn *conn;
+        while ((conn = next_job(pool, index)) == NULL) {
+        }
+
+        execute_command(conn);
+        rearm_conn(conn);
     }
+    return NULL;
+}
 
-    // Check if the -u flag is specified for unzipping
-    if (unzip_flag != NULL && strcmp(unzip_flag, "-u") == 0) {
-        // Send the TAR archive to the client for unzipping
-        // send_tar_file(tar_name, client_socket);
+void start_worker_pool(struct worker_pool *pool, int num_workers) {
+    pool->num_workers = num_workers;
+    pool->deques = calloc(num_workers, sizeof(*pool->deques));
+    if (pool->deques == NULL) {
+        perror("Error allocating worker deques");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        struct worker_arg *arg = malloc(sizeof(*arg));
+        if (arg == NULL) {
+            perror("Error allocating worker");
+            exit(1);
+        }
+        arg->pool = pool;
+        arg->index = i;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, arg) != 0) {
+            fprintf(stderr, "Error starting %s worker thread\n", pool->name);
+            exit(1);
+        }
+        pthread_detach(thread);
     }
+}
 
-    if (start_flag == 1) {
-        sprintf(response, "Tar archive created: %s", tar_name);
-        send(client_socket, &start_flag, sizeof(int), 0);
-        send_tar_file(tar_name, client_socket);
-    } else {
-        sprintf(response, "No file found");
-        send(client_socket, &start_flag, sizeof(int), 0);
+// Bytes still missing from the command frame being read: the rest of its header, then the rest of
+// its payload. Reads never go past the frame, so a command sent right behind it stays queued on
+// the socket and wakes the loop again once the connection is re-armed.
+size_t conn_frame_missing(const struct client_conn *conn) {
+    if (conn->received < FRAME_HEADER_SIZE) {
+        return FRAME_HEADER_SIZE - conn->received;
     }
+    struct frame_header header;
+    frame_header_unpack(conn->frame, &header);
+    return FRAME_HEADER_SIZE + header.length - conn->received;
 }
 
+// Reply to a command that is refused before it runs
+void refuse_command(struct client_conn *conn, const char *response) {
+    send_frame(conn->socket, FRAME_RESPONSE, FRAME_FLAG_ERROR, conn->request_id, response, strlen(response));
+}
 
-void handle_getdirf_command(char *arguments, char *response, int client_socket) {
-    // Tokenize the command arguments
-    char *date1 = strtok(arguments, " ");
-    char *date2 = strtok(NULL, " ");
-    char *unzip_flag = strtok(NULL, " ");
-    int start_flag = 1;
+// Advance the connection's state machine once a receive for it has completed
+void process_received(struct client_conn *conn, ssize_t bytes_received) {
+    struct frame_header header;
+    while (1) {
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            // The rest of the frame is still on its way
+            rearm_conn(conn);
+            return;
+        }
+        if (bytes_received <= 0) {
+            // Client disconnected or error occurred
+            close_conn(conn);
+            return;
+        }
+        conn->received += bytes_received;
+        if (conn->received >= FRAME_HEADER_SIZE) {
+            if (frame_header_unpack(conn->frame, &header) != 0 || header.type != FRAME_COMMAND ||
+                header.length > BUFFER_SIZE) {
+                // Nothing after a bad header can be trusted to start a frame
+                conn->request_id = header.request_id;
+                refuse_command(conn, header.length > BUFFER_SIZE ? "Command too long" : "Invalid frame");
+                close_conn(conn);
+                return;
+            }
+            if (conn->received == FRAME_HEADER_SIZE + header.length) {
+                break;
+            }
+        }
+        bytes_received = recv(conn->socket, conn->frame + conn->received, conn_frame_missing(conn), 0);
+    }
+    conn->received = 0;
+    conn->request_id = header.request_id;
+    memcpy(conn->buffer, conn->frame + FRAME_HEADER_SIZE, header.length);
+    conn->buffer[header.length] = '\0';
+
+    // Peek at the command type without tokenizing the buffer the worker will parse
+    char command_type[16];
+    size_t type_length = strcspn(conn->buffer, " ");
+    if (type_length >= sizeof(command_type)) {
+        type_length = sizeof(command_type) - 1;
+    }
+    memcpy(command_type, conn->buffer, type_length);
+    command_type[type_length] = '\0';
+
+    if (strcmp(command_type, "quit") == 0) {
+        // Handle 'quit' command
+        char quit_response[] = "Goodbye!";
+        send_frame(conn->socket, FRAME_RESPONSE, 0, conn->request_id, quit_response, strlen(quit_response));
+        close_conn(conn);
+    } else if (strcmp(command_type, "fgets") == 0 || strcmp(command_type, "tarfgetz") == 0 ||
+               strcmp(command_type, "filesrch") == 0 || strcmp(command_type, "targzf") == 0 ||
+               strcmp(command_type, "getdirf") == 0 || strcmp(command_type, "query") == 0) {
+        // Filesystem walks and archive builds never run on the event loop
+        struct worker_pool *pool = strcmp(command_type, "filesrch") == 0 ? &query_pool : &archive_pool;
+        conn->state = CONN_BUSY;
+        if (submit_job(pool, conn) < 0) {
+            refuse_command(conn, "Server busy");
+            rearm_conn(conn);
+        }
+    } else {
+        // Invalid command
+        refuse_command(conn, "Invalid command");
+        rearm_conn(conn);
+    }
+}
 
-    if (date1 == NULL || date2 == NULL) {
-        sprintf(response, "Invalid arguments");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
+// Advance the connection's state machine after epoll reports it readable
+void processclient(struct client_conn *conn) {
+    if (conn->state != CONN_READ_COMMAND) {
         return;
     }
 
-    // Get the user's home directory
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        sprintf(response, "Unable to get home directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
+    // Receive the next command frame, or as much of it as has arrived
+    process_received(conn, recv(conn->socket, conn->frame + conn->received, conn_frame_missing(conn), 0));
+}
+
+// Receive from every ready connection with one io_uring_enter() instead of one recv() each
+void processclients_batched(struct uring *ring, struct epoll_event *events, int ready) {
+    int queued = 0;
+    for (int i = 0; i < ready; i++) {
+        struct client_conn *conn = events[i].data.ptr;
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        if (sqe == NULL) {
+            processclient(conn);
+            continue;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->socket;
+        sqe->addr = (unsigned long) (conn->frame + conn->received);
+        sqe->len = conn_frame_missing(conn);
+        sqe->user_data = (unsigned long) conn;
+        queued++;
+    }
+    if (queued > 0 && uring_submit(ring, queued) < 0) {
+        perror("Error submitting receives");
         return;
     }
+    for (int i = 0; i < queued; i++) {
+        struct io_uring_cqe cqe;
+        if (uring_next_completion(ring, &cqe) < 0) {
+            perror("Error reaping receives");
+            return;
+        }
+        if (cqe.res < 0) {
+            errno = -cqe.res;
+        }
+        process_received((struct client_conn *) (unsigned long) cqe.user_data, cqe.res < 0 ? -1 : cqe.res);
+    }
+}
+
+void *event_loop_main(void *arg) {
+    int epoll_fd = *(int *) arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            break;
+        }
+        struct uring *ring = uring_for_thread();
+        if (ring != NULL) {
+            processclients_batched(ring, events, ready);
+            continue;
+        }
+        for (int i = 0; i < ready; i++) {
+            processclient(events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+void start_event_loops(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    start_worker_pool(&archive_pool, cores > 0 ? (int) cores : 1);
+    start_worker_pool(&query_pool, QUERY_THREADS);
+    start_compress_pool(cores > 0 ? (int) cores : 1);
+
+    for (int i = 0; i < EVENT_LOOPS; i++) {
+        event_loop_fds[i] = epoll_create1(EPOLL_CLOEXEC);
+        if (event_loop_fds[i] < 0) {
+            perror("Error creating epoll instance");
+            exit(1);
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, event_loop_main, &event_loop_fds[i]) != 0) {
+            perror("Error starting event loop");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
 
-    // Create a directory to store the TAR archive
-    char dir_name[PATH_MAX];
-    snprintf(dir_name, sizeof(dir_name), "%d", (int) getpid());
-    if (mkdir(dir_name, 0777) != 0 && errno != EEXIST) {
-        perror("Error creating directory");
-        sprintf(response, "Error creating directory");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
+// Hand an accepted client to one of the event loops
+void server_connections(int client_socket) {
+    struct client_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        perror("Error allocating client connection");
+        close(client_socket);
         return;
     }
 
-    // Create a temporary TAR file name
-    char tar_name[PATH_MAX];
-    snprintf(tar_name, sizeof(tar_name), "%s/temp.tar.gz", dir_name);
+    int conn_id = __atomic_fetch_add(&next_conn_id, 1, __ATOMIC_RELAXED);
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+    conn->socket = client_socket;
+    conn->conn_id = conn_id;
+    conn->epoll_fd = event_loop_fds[conn_id % EVENT_LOOPS];
+    conn->state = CONN_READ_COMMAND;
+    local_session_delta(1);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn};
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+        perror("Error registering client connection");
+        close_conn(conn);
+    }
+}
+
+// ---------------------------------------- forwarding proxy ----------------------------------------
+
+#define PROXY_PIPE_SIZE (1 << 20)
+
+// One direction of a forwarded session. Bytes move socket -> pipe -> socket with splice(),
+// so payloads are never copied through user space and NUL bytes pass through untouched.
+struct proxy_half {
+    int from;
+    int to;
+    int pipe_fds[2];
+    size_t capacity;
+    size_t buffered;
+    int eof;
+    int shut;
+    int keep_open;
+    int counted_type;   // frame type counted in counted
+    uint32_t counted;   // frames of counted_type passed on so far
+    size_t frame_left;  // bytes of the current frame not yet moved into the pipe
+    int hand_back;      // a command the mirror cannot serve waits unread at the frame boundary
+};
+
+struct proxy_session {
+    int client_sd;
+    int mirror_sd;
+    struct proxy_half upstream;
+    struct proxy_half downstream;
+};
 
-    // Use the find command to search for files within the specified date range
-    char find_command[512];
-    snprintf(find_command, sizeof(find_command), "find %s -type f -newermt %s ! -newermt %s > %s/file_list.txt",
-             home_dir, date1, date2, dir_name);
+static int proxy_epoll_fd = -1;
 
-    if (system(find_command) != 0) {
-        sprintf(response, "Error creating TAR archive");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+int proxy_half_init(struct proxy_half *half, int from, int to) {
+    memset(half, 0, sizeof(*half));
+    half->from = from;
+    half->to = to;
+    if (pipe2(half->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
     }
+    fcntl(half->pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    int capacity = fcntl(half->pipe_fds[1], F_GETPIPE_SZ);
+    half->capacity = capacity > 0 ? (size_t) capacity : 65536;
+    return 0;
+}
 
-    // Create the TAR archive using the file list
-    char tar_command[512];
-    snprintf(tar_command, sizeof(tar_command), "tar czf %s -T %s/file_list.txt", tar_name, dir_name);
-    if (system(tar_command) != 0) {
-        sprintf(response, "Error creating TAR archive");
-        start_flag = 0;
-        send(client_socket, &start_flag, sizeof(int), 0);
-        return;
+// At a frame boundary, look at the next header before any of its frame is moved. A partial
+// header is left on the socket; the rest of it arriving wakes the loop again.
+int proxy_next_frame(struct proxy_half *half) {
+    unsigned char peeked[FRAME_HEADER_SIZE + 6];
+    struct frame_header header;
+    ssize_t length = recv(half->from, peeked, sizeof(peeked), MSG_PEEK | MSG_DONTWAIT);
+    if (length == 0) {
+        half->eof = 1;
+        return 0;
+    }
+    if (length < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    if (length < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    if (frame_header_unpack(peeked, &header) != 0) {
+        // Nothing after a bad header can be trusted to start a frame
+        return -1;
+    }
+    if (half->keep_open && header.type == FRAME_COMMAND) {
+        size_t known = header.length < 6 ? header.length : 6;
+        if ((size_t) length < FRAME_HEADER_SIZE + known) {
+            return 0;
+        }
+        const unsigned char *command = peeked + FRAME_HEADER_SIZE;
+        if (header.length == 4 && memcmp(command, "quit", 4) == 0) {
+            // The client's quit ends its session but not the pooled one behind it, so it is
+            // swallowed here instead of being passed to the mirror
+            recv(half->from, peeked, FRAME_HEADER_SIZE + 4, MSG_DONTWAIT);
+            half->eof = 1;
+            return 0;
+        }
+        if (header.length >= 5 && memcmp(command, "query", 5) == 0 && (header.length == 5 || command[5] == ' ')) {
+            // The mirror has no query; the client is handed back to the local event loop with
+            // this command still unread once the mirror has answered everything before it
+            half->hand_back = 1;
+            return 0;
+        }
+    }
+    if (header.type == half->counted_type) {
+        half->counted++;
+    }
+    half->frame_left = FRAME_HEADER_SIZE + header.length;
+    return 0;
+}
+
+// Move as much as both sockets allow, one frame at a time; returns -1 when the session has to
+// be torn down
+int proxy_pump(struct proxy_half *half) {
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        if (!half->eof && !half->hand_back && half->frame_left == 0 && proxy_next_frame(half) < 0) {
+            return -1;
+        }
+        if (!half->eof && half->frame_left > 0 && half->buffered < half->capacity) {
+            size_t room = half->capacity - half->buffered;
+            ssize_t moved = splice(half->from, NULL, half->pipe_fds[1], NULL,
+                                   room < half->frame_left ? room : half->frame_left,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                half->buffered += moved;
+                half->frame_left -= moved;
+                progress = 1;
+            } else if (moved == 0) {
+                half->eof = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        if (half->buffered > 0) {
+            ssize_t moved = splice(half->pipe_fds[0], NULL, half->to, NULL, half->buffered,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                half->buffered -= moved;
+                progress = 1;
+            } else if (moved < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
     }
 
-    // Check if the -u flag is specified for unzipping
-    if (unzip_flag != NULL && strcmp(unzip_flag, "-u") == 0) {
-        // Send the TAR archive to the client for unzipping
-        // send_tar_file(tar_name, client_socket);
+    // Pass the half-close on once everything the source sent has been delivered
+    if (half->eof && half->buffered == 0 && !half->shut) {
+        if (!half->keep_open) {
+            shutdown(half->to, SHUT_WR);
+        }
+        half->shut = 1;
     }
+    return 0;
+}
+
+// Between frames in both directions with every forwarded command answered
+int proxy_idle(const struct proxy_session *session) {
+    return !session->downstream.eof && session->downstream.buffered == 0 && session->upstream.buffered == 0 &&
+           session->downstream.frame_left == 0 && session->upstream.frame_left == 0 &&
+           session->upstream.counted == session->downstream.counted;
+}
 
-    if (start_flag == 1) {
-        sprintf(response, "Tar archive created: %s", tar_name);
-        send(client_socket, &start_flag, sizeof(int), 0);
-        send_tar_file(tar_name, client_socket);
+// Ends the forwarding. With hand_back the client carries on as a local connection, its next
+// command still unread on the socket; otherwise it is closed.
+void proxy_close(struct proxy_session *session, int hand_back) {
+    int client_sd = session->client_sd;
+    epoll_ctl(proxy_epoll_fd, EPOLL_CTL_DEL, client_sd, NULL);
+    if (!hand_back) {
+        close(client_sd);
+    }
+    // A mirror session goes back to the pool only when idle; otherwise the next client to borrow
+    // it would read the rest of this one's reply
+    epoll_ctl(proxy_epoll_fd, EPOLL_CTL_DEL, session->mirror_sd, NULL);
+    if (proxy_idle(session)) {
+        upstream_release(session->mirror_sd);
     } else {
-        sprintf(response, "No file found");
-        send(client_socket, &start_flag, sizeof(int), 0);
+        close(session->mirror_sd);
+    }
+    close(session->upstream.pipe_fds[0]);
+    close(session->upstream.pipe_fds[1]);
+    close(session->downstream.pipe_fds[0]);
+    close(session->downstream.pipe_fds[1]);
+    free(session);
+
+    pthread_mutex_lock(&balancer_lock);
+    if (mirror_backend.outstanding > 0) {
+        mirror_backend.outstanding--;
+    }
+    pthread_mutex_unlock(&balancer_lock);
+    if (hand_back) {
+        server_connections(client_sd);
     }
-
 }
 
+void *proxy_loop_main(void *arg) {
+    (void) arg;
+    struct epoll_event events[MAX_EVENTS];
 
-void processclient(int client_socket, pid_t pro_id) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    printf("%d\n", client_socket);
     while (1) {
-        // Receive command from the client
-        bytes_received = read(client_socket, buffer, 1024);
-        // bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            // Client disconnected or error occurred
+        int ready = epoll_wait(proxy_epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for proxy events");
             break;
         }
-
-        buffer[bytes_received] = '\0';
-
-        // // Validate the received command syntax
-        // if (!validate_command(buffer)) {
-        //     char response[] = "Invalid command syntax";
-        //     send(client_socket, response, strlen(response), 0);
-        //     continue;
-        // }
-
-        // Process the client command and send appropriate responses
-        char response[BUFFER_SIZE] = {0};
-
-        // Tokenize the command to extract the command type and arguments
-        char *command_type = strtok(buffer, " ");
-        char *arguments = strtok(NULL, "");
-
-        if (strcmp(command_type, "fgets") == 0) {
-            handle_fgets_command(arguments, response, pro_id, client_socket);
-        } else if (strcmp(command_type, "tarfgetz") == 0) {
-            handle_tarfgetz_command(arguments, response, pro_id, client_socket);
-        } else if (strcmp(command_type, "filesrch") == 0) {
-            handle_filesrch_command(arguments, response, client_socket);
-        } else if (strcmp(command_type, "targzf") == 0) {
-            handle_targzf_command(arguments, response, pro_id, client_socket);
-        } else if (strcmp(command_type, "getdirf") == 0) {
-            handle_getdirf_command(arguments, response, client_socket);
-        } else if (strcmp(command_type, "quit") == 0) {
-            // Handle 'quit' command
-            char quit_response[] = "Goodbye!";
-            send(client_socket, quit_response, strlen(quit_response), 0);
-            break;
-        } else {
-            // Invalid command
-            char invalid_response[] = "Invalid command";
-            send(client_socket, invalid_response, strlen(invalid_response), 0);
+        for (int i = 0; i < ready; i++) {
+            struct proxy_session *session = events[i].data.ptr;
+            if (session == NULL) {
+                // Already torn down by an earlier event in this batch
+                continue;
+            }
+            // Edge-triggered: either socket changing state can unblock either direction
+            int failed = proxy_pump(&session->upstream) < 0 || proxy_pump(&session->downstream) < 0;
+            // The session ends once the client is done and either the mirror has closed its side or
+            // every command forwarded has been answered, so a reply to a command pipelined ahead
+            // of quit or a half-close still reaches the client
+            int finished = session->upstream.shut && (session->downstream.shut || proxy_idle(session));
+            int hand_back = !failed && !finished && session->upstream.hand_back && proxy_idle(session);
+            if (failed || finished || hand_back) {
+                for (int j = i + 1; j < ready; j++) {
+                    if (events[j].data.ptr == session) {
+                        events[j].data.ptr = NULL;
+                    }
+                }
+                proxy_close(session, hand_back);
+            }
         }
-
-        // Send the response back to the client
-        printf("%s", response);
-        send(client_socket, response, strlen(response), 0);
     }
+    return NULL;
 }
 
-void server_connections(int server_socket) {
-    int client_socket = accept(server_socket, (struct sockaddr *) NULL, NULL);
-    if (client_socket < 0) {
-        perror("Error accepting client connection");
+void start_proxy_loop(void) {
+    proxy_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (proxy_epoll_fd < 0) {
+        perror("Error creating proxy epoll instance");
+        exit(1);
     }
-    pid_t child_pid;
-
-    // Fork a child process to handle the client request
-    child_pid = fork();
-    if (child_pid < 0) {
-        perror("Error forking child process");
-        close(client_socket);
-    } else if (child_pid == 0) {
-        // Child process
-        pid_t pro_id = getpid();
-        processclient(client_socket, pro_id);
-    } else {
-        // Parent process
-        close(client_socket);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, proxy_loop_main, NULL) != 0) {
+        perror("Error starting proxy loop");
+        exit(1);
     }
+    pthread_detach(thread);
 }
 
-void route_forward(char *mirror_ip, int mirror_port, int server_sd) {
-    int client_sd = accept(server_sd, (struct sockaddr *) NULL, NULL);
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        int server_mirror_sd;
-        struct sockaddr_in mirror_addr;
-        server_mirror_sd = socket(AF_INET, SOCK_STREAM, 0);
-
-        memset(&mirror_addr, 0, sizeof(mirror_addr));
-        mirror_addr.sin_family = AF_INET;
-        mirror_addr.sin_port = htons((uint16_t) mirror_port);//Port number
-
-        if (inet_pton(AF_INET, mirror_ip, &mirror_addr.sin_addr) < 0) {
-            fprintf(stderr, " inet_pton() has failed\n");
-            exit(2);
-        }
-
-        // Connect to the server
-        if (connect(server_mirror_sd, (struct sockaddrnano *) &mirror_addr, sizeof(mirror_addr)) < 0) {//Connect()
-            perror("Error connecting to server");
-            close(server_mirror_sd);
-            exit(3);
-        }
-        printf("client_Sd :: => :: %d\n", client_sd);
-        printf("server_sd :: => :: %d\n", server_sd);
-        printf("server_mirror_sd :: => :: %d\n", server_mirror_sd);
-        pid_t child_pid = getpid();
-        printf("child_pid :: => :: %d\n", child_pid);
-        printf("parent pid :: => :: %d\n", getpgid(child_pid));
-        while (1) {
-            char client_input[1024];
-            char mirror_output[1024];
-            recv(client_sd, client_input, sizeof(client_input), 0);
-            printf("client_input :: => :: %s\n", client_input);
-            send(server_mirror_sd, client_input, strlen(client_input), 0);
-            if (strcmp(client_input, "quit") == 0) {
-                printf("quit\n");
-                close(server_mirror_sd);
-                kill(child_pid, 0);
-                exit(0);
-            }
-            recv(server_mirror_sd, mirror_output, sizeof(mirror_output), 0);
-            send(client_sd, mirror_output, strlen(mirror_output), 0);
-            memset(client_input, 0, sizeof(client_input));
-        }
-    } else {
+// Relay a client to the mirror in both directions at once until either side closes
+void route_forward(int client_sd, int server_mirror_sd) {
+    struct proxy_session *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        perror("Error allocating proxy session");
+        close(client_sd);
+        close(server_mirror_sd);
+        return;
+    }
+    session->client_sd = client_sd;
+    session->mirror_sd = server_mirror_sd;
+    if (proxy_half_init(&session->upstream, client_sd, server_mirror_sd) < 0) {
+        perror("Error creating proxy pipe");
+        close(client_sd);
+        close(server_mirror_sd);
+        free(session);
+        return;
+    }
+    session->upstream.keep_open = 1;
+    session->upstream.counted_type = FRAME_COMMAND;
+    if (proxy_half_init(&session->downstream, server_mirror_sd, client_sd) < 0) {
+        perror("Error creating proxy pipe");
+        close(session->upstream.pipe_fds[0]);
+        close(session->upstream.pipe_fds[1]);
+        close(client_sd);
+        close(server_mirror_sd);
+        free(session);
+        return;
+    }
+    session->downstream.counted_type = FRAME_RESPONSE;
+
+    fcntl(client_sd, F_SETFL, fcntl(client_sd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_mirror_sd, F_SETFL, fcntl(server_mirror_sd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = session};
+    if (epoll_ctl(proxy_epoll_fd, EPOLL_CTL_ADD, client_sd, &event) < 0 ||
+        epoll_ctl(proxy_epoll_fd, EPOLL_CTL_ADD, server_mirror_sd, &event) < 0) {
+        perror("Error registering proxy session");
+        proxy_close(session, 0);
     }
 }
 
-int main(int argc, char *argv[]) {
+// ---------------------------------------- acceptors ----------------------------------------
+
+#define DEFAULT_BACKLOG 128
+
+static int listen_port;
+static int listen_backlog = DEFAULT_BACKLOG;
+static int num_acceptors = 1;
+
+// With more than one acceptor every loop binds its own SO_REUSEPORT socket and the kernel
+// spreads incoming connections across them
+int open_listener(int reuse_port) {
     int server_sd;
     struct sockaddr_in server_addr;
-
+    int enable = 1;
 
     if ((server_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         fprintf(stderr, "Could not create socket\n");
         exit(1);
     }
+    if (reuse_port && setsockopt(server_sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("Error enabling SO_REUSEPORT");
+        close(server_sd);
+        exit(1);
+    }
 
     // Setup server address
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons((uint16_t) atoi(argv[1]));
+    server_addr.sin_port = htons((uint16_t) listen_port);
 
 
     // Bind socket to address and port
@@ -948,37 +6117,124 @@ int main(int argc, char *argv[]) {
     }
 
     // Listen for client connections
-    if (listen(server_sd, 5) < 0) {
+    if (listen(server_sd, listen_backlog) < 0) {
         perror("Error listening");
         close(server_sd);
         exit(1);
     }
+    return server_sd;
+}
 
-    int client_connections = 0;
+void accept_loop(int server_sd) {
     while (1) {
-        if (client_connections < 6) {
-            server_connections(server_sd);
-            client_connections = client_connections + 1;
-            //server
-        } else if (client_connections < 12) {
-            route_forward(argv[2], atoi(argv[3]), server_sd);
-            client_connections = client_connections + 1;
-            //mirror
-        } else {
-            if (client_connections % 2 != 0) {
-                server_connections(server_sd);
-                client_connections = client_connections + 1;
-                //server
-            } else if (client_connections % 2 == 0) {
-                route_forward(argv[1], atoi(argv[3]), server_sd);
-                client_connections = client_connections + 1;
-                //mirror
-            } else {
-                break;
+        // Accept client connection
+        int client_sd = accept(server_sd, (struct sockaddr *) NULL, NULL);
+        if (client_sd < 0) {
+            perror("Error accepting client connection");
+            continue;
+        }
+
+        if (route_to_mirror()) {
+            int mirror_sd = upstream_acquire();
+            if (mirror_sd >= 0) {
+                route_forward(client_sd, mirror_sd);
+                continue;
             }
+            // The mirror went away since the last probe; serve the client here instead
+            pthread_mutex_lock(&balancer_lock);
+            mirror_backend.healthy = 0;
+            mirror_backend.outstanding--;
+            pthread_mutex_unlock(&balancer_lock);
+        }
+        server_connections(client_sd);
+    }
+}
+
+void *acceptor_main(void *arg) {
+    int index = (int) (long) arg;
+
+    // Keep each accept loop on its own core so the kernel's per-socket spreading sticks
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    accept_loop(open_listener(1));
+    return NULL;
+}
+
+void start_acceptors(void) {
+    if (num_acceptors == 1) {
+        accept_loop(open_listener(0));
+        return;
+    }
+
+    pthread_t threads[num_acceptors];
+    for (int i = 0; i < num_acceptors; i++) {
+        if (pthread_create(&threads[i], NULL, acceptor_main, (void *) (long) i) != 0) {
+            perror("Error starting acceptor");
+            exit(1);
         }
     }
+    for (int i = 0; i < num_acceptors; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p lor|ewma] [-a acceptors] [-b backlog] [-I sync|uring] "
+                    "[-C cache_dir] [-S cache_mb] <port> <mirror_ip> <mirror_port>\n", program);
+    exit(1);
+}
 
-    close(server_sd);
+int main(int argc, char *argv[]) {
+    int option;
+
+    while ((option = getopt(argc, argv, "p:a:b:I:C:S:")) != -1) {
+        if (option == 'p' && strcmp(optarg, "lor") == 0) {
+            balance_policy = BALANCE_LEAST_OUTSTANDING;
+        } else if (option == 'p' && strcmp(optarg, "ewma") == 0) {
+            balance_policy = BALANCE_EWMA_LATENCY;
+        } else if (option == 'a' && atoi(optarg) > 0) {
+            num_acceptors = atoi(optarg);
+        } else if (option == 'b' && atoi(optarg) > 0) {
+            listen_backlog = atoi(optarg);
+        } else if (option == 'I' && strcmp(optarg, "sync") == 0) {
+            io_backend = IO_BACKEND_SYNC;
+        } else if (option == 'I' && strcmp(optarg, "uring") == 0) {
+            io_backend = IO_BACKEND_URING;
+        } else if (option == 'C') {
+            archive_cache.dir = optarg;
+        } else if (option == 'S' && atoi(optarg) >= 0) {
+            archive_cache.budget = atoi(optarg) * 1024ULL * 1024ULL; // 0 keeps nothing
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3) {
+        usage(argv[0]);
+    }
+    listen_port = atoi(argv[optind]);
+    mirror_ip = argv[optind + 1];
+    mirror_port = atoi(argv[optind + 2]);
+
+    // A vanished client must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    block_shutdown_signals();
+    load_archive_cache();
+    select_scan_kernels();
+    watch_file_index();
+    if (load_index_snapshot() != 0) {
+        build_file_index();
+    }
+    start_index_watcher();
+    start_snapshot_writer();
+    start_event_loops();
+    start_proxy_loop();
+    start_balancer();
+    start_acceptors();
     return 0;
-}
\ No newline at end of file
+}